@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Headless benchmark of the terminal pipeline: canned output is parsed by
+ * libteken into a terminal, which is drawn into a framebuffer in memory,
+ * the same way as fbteken does it on every vblank.
+ */
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "term.h"
+
+struct outbuf {
+	char *p;
+	size_t len, size;
+};
+
+struct workload {
+	const char *name;
+	void (*gen)(struct outbuf *, size_t);
+};
+
+static unsigned int cols = 240, rows = 67;
+static uint32_t rndstate = 1;
+
+static uint32_t
+rnd(void)
+{
+	/* xorshift32, so that the workloads are the same everywhere */
+	rndstate ^= rndstate << 13;
+	rndstate ^= rndstate >> 17;
+	rndstate ^= rndstate << 5;
+	return rndstate;
+}
+
+static void
+put(struct outbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(1, "vsnprintf");
+		if ((size_t)n < b->size - b->len)
+			break;
+		b->size = b->size * 2 + n;
+		b->p = realloc(b->p, b->size);
+		if (b->p == NULL)
+			err(1, "realloc");
+	}
+	b->len += n;
+}
+
+static void
+putword(struct outbuf *b, unsigned int n)
+{
+	while (n-- > 0)
+		put(b, "%c", 'a' + rnd() % 26);
+}
+
+/* Plain lines of ASCII text, like cat(1) of a big file */
+static void
+gen_ascii(struct outbuf *b, size_t size)
+{
+	unsigned int i, n;
+
+	while (b->len < size) {
+		n = rnd() % cols;
+		for (i = 0; i < n; i++)
+			put(b, "%c", ' ' + rnd() % 95);
+		put(b, "\r\n");
+	}
+}
+
+/* Colourful ls --color output */
+static void
+gen_color(struct outbuf *b, size_t size)
+{
+	static const char *colors[] = {
+		"00", "01;34", "01;32", "01;36", "40;33;01", "01;35", "01;31",
+	};
+	unsigned int x, n;
+
+	while (b->len < size) {
+		for (x = 0; x + 20 <= cols; x += 20) {
+			n = 3 + rnd() % 14;
+			put(b, "\033[%sm", colors[rnd() % NELEM(colors)]);
+			putword(b, n);
+			put(b, "\033[0m%*s", 20 - n, "");
+		}
+		put(b, "\r\n");
+	}
+}
+
+/* Syntax highlighting with 256 and 24-bit colors, like a themed editor */
+static void
+gen_rgb(struct outbuf *b, size_t size)
+{
+	unsigned int x, n, c;
+
+	while (b->len < size) {
+		for (x = 0; x + 8 <= cols; x += n + 1) {
+			n = MIN(1 + rnd() % 12, cols - x);
+			c = rnd();
+			if (c & 1) {
+				put(b, "\033[38;5;%um", 16 + c % 240);
+			} else {
+				/* A theme has a few dozen colors at most */
+				c = c % 48 * 0x050403;
+				put(b, "\033[38;2;%u;%u;%um", c >> 16 & 0xff,
+				    c >> 8 & 0xff, c & 0xff);
+			}
+			putword(b, n);
+			put(b, " ");
+		}
+		put(b, "\033[m\r\n");
+	}
+}
+
+/* Full-screen redraws by a curses application, like top(1) */
+static void
+gen_curses(struct outbuf *b, size_t size)
+{
+	unsigned int x, y, n;
+
+	while (b->len < size) {
+		put(b, "\033[H\033[7m");
+		putword(b, cols);
+		put(b, "\033[m");
+		for (y = 2; y <= rows; y++) {
+			put(b, "\033[%u;1H", y);
+			for (x = 0; x < cols; x += n + 1) {
+				n = MIN(1 + rnd() % 12, cols - x);
+				put(b, "\033[3%um", rnd() % 8);
+				putword(b, n);
+				/* Don't wrap, which would scroll the screen */
+				if (x + n < cols)
+					put(b, " ");
+			}
+		}
+		put(b, "\033[m\033[%u;1H", rows);
+	}
+}
+
+/* Lines of double-width CJK characters */
+static void
+gen_cjk(struct outbuf *b, size_t size)
+{
+	unsigned int i, n, ch;
+
+	while (b->len < size) {
+		n = rnd() % (cols / 2);
+		for (i = 0; i < n; i++) {
+			ch = 0x4e00 + rnd() % 0x5200;
+			put(b, "%c%c%c", 0xe0 | ch >> 12,
+			    0x80 | (ch >> 6 & 0x3f), 0x80 | (ch & 0x3f));
+		}
+		put(b, "\r\n");
+	}
+}
+
+/* Scrolling inside a region, with a status line below it */
+static void
+gen_scroll(struct outbuf *b, size_t size)
+{
+	unsigned int n;
+
+	put(b, "\033[2J\033[2;%ur", rows - 1);
+	while (b->len < size) {
+		n = rnd() % 8;
+		if (n == 0) {
+			/* Scroll back down from the top of the region */
+			put(b, "\033[2;1H\033M");
+		} else {
+			put(b, "\033[%u;1H\n", rows - 1);
+		}
+		putword(b, rnd() % cols);
+		if (n == 1) {
+			put(b, "\033[%u;1H\033[7m", rows);
+			putword(b, cols / 2);
+			put(b, "\033[m");
+		}
+	}
+	put(b, "\033[r");
+}
+
+static const struct workload workloads[] = {
+	{ "ascii", gen_ascii },
+	{ "color", gen_color },
+	{ "rgb", gen_rgb },
+	{ "curses", gen_curses },
+	{ "cjk", gen_cjk },
+	{ "scroll", gen_scroll },
+};
+
+static double
+elapsed(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+term_reset(struct terminal *t, unsigned int histsize)
+{
+	teken_pos_t winsize;
+	unsigned int i;
+
+	if (t->hist != NULL)
+		history_free(t->hist);
+	t->hist = NULL;
+	if (histsize > 0) {
+		t->hist = history_init(cols, (size_t)histsize * 1024 * 1024);
+		if (t->hist == NULL)
+			errx(1, "Failed to allocate history buffer");
+	}
+	cellbuf_free(&t->buf);
+	if (cellbuf_init(&t->buf, cols, rows) != 0)
+		errx(1, "Failed to allocate terminal buffer");
+	for (i = 0; i < cols * rows; i++)
+		t->buf.cells[i] = make_cell(' ', &defattr);
+	for (i = 0; i < rows; i++)
+		mark_damage(i, 0, cols);
+	winsize.tp_col = cols;
+	winsize.tp_row = rows;
+	teken_init(&t->tek, &tek_funcs, t);
+	teken_set_defattr(&t->tek, &defattr);
+	teken_set_winsize(&t->tek, &winsize);
+	t->winsz.ws_col = cols;
+	t->winsz.ws_row = rows;
+	t->cursorpos.tp_col = t->cursorpos.tp_row = 0;
+	t->showcursor = 1;
+	t->shown = true;
+}
+
+static void
+run(const struct workload *w, struct terminal *t, size_t size, size_t chunk,
+    unsigned int histsize)
+{
+	struct outbuf b = { NULL, 0, 0 };
+	struct timespec t0, t1, t2;
+	double parse = 0, draw = 0, p50 = 0, p99 = 0, *frames = NULL;
+	uint64_t cells = 0;
+	size_t off, n, nframes = 0;
+	unsigned int i;
+
+	rndstate = 1;
+	w->gen(&b, size);
+	frames = calloc(b.len / chunk + 2, sizeof(double));
+	if (frames == NULL)
+		err(1, "calloc");
+	term_reset(t, histsize);
+	redraw_term(t);
+
+	for (off = 0; off < b.len; off += n) {
+		n = MIN(chunk, b.len - off);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		teken_input(&t->tek, b.p + off, n);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (!damaged && cursor_moved(t))
+			damaged = true;
+		parse += elapsed(&t0, &t1);
+		if (!damaged)
+			continue;
+		cells += redraw_term(t);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		draw += elapsed(&t1, &t2);
+		frames[nframes++] = elapsed(&t1, &t2);
+		for (i = 0; i < rows; i++)
+			framedamage[i].x0 = framedamage[i].x1 = 0;
+	}
+
+	qsort(frames, nframes, sizeof(double), cmpdouble);
+	if (nframes > 0) {
+		p50 = frames[nframes / 2];
+		p99 = frames[nframes * 99 / 100];
+	}
+	printf("%-8s %8.1f MB/s %8zu frames %8.2f Mcells/s "
+	    "p50 %7.3f ms p99 %7.3f ms\n", w->name,
+	    b.len / parse / 1e6, nframes, draw > 0 ? cells / draw / 1e6 : 0,
+	    p50 * 1e3, p99 * 1e3);
+	free(frames);
+	free(b.p);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: %s [-A] [-b chunksize] [-c cachesize] [-f fontfile "
+	    "[-F bold_fontfile]] [-g colsxrows] [-H histsize] [-n size] "
+	    "[-s fontsize] [-t threads] [workload ...]\n",
+	    getprogname());
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct terminal t;
+	char *normalfont = NULL, *boldfont = NULL;
+	const char *errstr;
+	uint32_t *fb;
+	size_t chunk = 4096, size = 8;
+	unsigned int histsize = 4, i;
+	int ch, j, cachesize = -1, fontheight = 16;
+	bool alpha = true, found;
+
+	while ((ch = getopt(argc, argv, "Ab:c:f:F:g:H:n:s:t:")) != -1) {
+		switch (ch) {
+		case 'A':
+			alpha = false;
+			break;
+		case 'b':
+			chunk = strtonum(optarg, 1, 1024 * 1024, &errstr);
+			if (errstr)
+				errx(1, "chunk size is %s: %s", errstr, optarg);
+			break;
+		case 'c':
+			cachesize = strtonum(optarg, 0, 1024 * 1024, &errstr);
+			if (errstr)
+				errx(1, "cache size is %s: %s", errstr, optarg);
+			break;
+		case 'f':
+			normalfont = optarg;
+			break;
+		case 'F':
+			boldfont = optarg;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%ux%u", &cols, &rows) != 2 ||
+			    cols < 20 || cols > 1000 || rows < 3 || rows > 1000)
+				errx(1, "invalid geometry: %s", optarg);
+			break;
+		case 'H':
+			histsize = strtonum(optarg, 0, 1024, &errstr);
+			if (errstr)
+				errx(1, "history size is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			size = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr)
+				errx(1, "size is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			fontheight = strtonum(optarg, 6, 128, &errstr);
+			if (errstr)
+				errx(1, "font height is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			nrenderers = strtonum(optarg, 1, MAXRENDERERS + 1,
+			    &errstr) - 1;
+			if (errstr) {
+				errx(1, "number of drawing threads is %s: %s",
+				    errstr, optarg);
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < NELEM(workloads); i++) {
+			if (strcmp(argv[j], workloads[i].name) == 0)
+				break;
+		}
+		if (i == NELEM(workloads))
+			errx(1, "unknown workload: %s", argv[j]);
+	}
+
+	rop = rop32_init(normalfont, boldfont, fontheight, &fnwidth,
+	    &fnheight, alpha);
+	if (rop == NULL)
+		errx(1, "rop32_init failed, aborting");
+	for (i = 0; i < nrenderers; i++) {
+		renderers[i].rop = rop32_init(normalfont, boldfont,
+		    fontheight, &fnwidth, &fnheight, alpha);
+		if (renderers[i].rop == NULL)
+			errx(1, "rop32_init failed, aborting");
+	}
+	fb = calloc((size_t)cols * fnwidth * rows * fnheight, sizeof(uint32_t));
+	if (fb == NULL)
+		err(1, "calloc");
+	rop32_setclip(rop, (point){0, 0},
+	    (point){cols * fnwidth, rows * fnheight});
+	if (cachesize >= 0)
+		rop32_setcachesize(rop, (size_t)cachesize * 1024);
+	for (i = 0; i < nrenderers; i++) {
+		rop32_setclip(renderers[i].rop, (point){0, 0},
+		    (point){cols * fnwidth, rows * fnheight});
+		if (cachesize >= 0) {
+			rop32_setcachesize(renderers[i].rop,
+			    (size_t)cachesize * 1024);
+		}
+	}
+	set_drawcontext(fb, cols * fnwidth);
+	if (redraw_init(cols, rows, &defattr) != 0)
+		errx(1, "Failed to allocate drawing state");
+
+	memset(&t, 0, sizeof(t));
+	if (nrenderers > 0)
+		renderers_start();
+
+	printf("%ux%u cells, %dx%d font, %u thread(s), %zu MiB per workload\n",
+	    cols, rows, fnwidth, fnheight, nrenderers + 1, size);
+	for (i = 0; i < NELEM(workloads); i++) {
+		found = argc == 0;
+		for (j = 0; j < argc; j++) {
+			if (strcmp(argv[j], workloads[i].name) == 0)
+				found = true;
+		}
+		if (found) {
+			run(&workloads[i], &t, size * 1024 * 1024, chunk,
+			    histsize);
+		}
+	}
+
+	if (nrenderers > 0)
+		renderers_stop();
+	if (t.hist != NULL)
+		history_free(t.hist);
+	cellbuf_free(&t.buf);
+	redraw_free();
+	free(fb);
+
+	return 0;
+}
@@ -54,15 +54,25 @@
 #define	TS_CONS25	0x0040	/* cons25 emulation. */
 #define	TS_INSTRING	0x0080	/* Inside string. */
 #define	TS_CURSORKEYS	0x0100	/* Cursor keys mode. */
+#define	TS_ZWJ		0x0200	/* Join the next character to the last one. */
 
 /* Character that blanks a cell. */
 #define	BLANK	' '
+/* Character that replaces malformed UTF-8. */
+#define	REPLACEMENT	0xfffd
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "teken.h"
 #include "teken_wcwidth.h"
 #include "teken_scs.h"
 
-static teken_state_t	teken_state_init;
+/* Ground state of the escape sequence parser. */
+#define	TEKEN_S_INIT	0
+
+static void	teken_state_input(teken_t *, teken_char_t);
 
 /*
  * Wrappers for hooks.
@@ -96,6 +106,37 @@ teken_funcs_putchar(teken_t *t, const teken_pos_t *p, teken_char_t c,
 	t->t_funcs->tf_putchar(t->t_softc, p, c, a);
 }
 
+static inline void
+teken_funcs_putchars(teken_t *t, const teken_pos_t *p, const teken_char_t *c,
+    unsigned int n, const teken_attr_t *a)
+{
+	teken_pos_t tp;
+	unsigned int i;
+
+	teken_assert(p->tp_row < t->t_winsize.tp_row);
+	teken_assert(p->tp_col + n <= t->t_winsize.tp_col);
+
+	if (t->t_funcs->tf_putchars != NULL) {
+		t->t_funcs->tf_putchars(t->t_softc, p, c, n, a);
+		return;
+	}
+	tp = *p;
+	for (i = 0; i < n; i++) {
+		t->t_funcs->tf_putchar(t->t_softc, &tp, c[i], a);
+		tp.tp_col++;
+	}
+}
+
+static inline void
+teken_funcs_combine(teken_t *t, const teken_pos_t *p, teken_char_t c)
+{
+
+	teken_assert(p->tp_row < t->t_winsize.tp_row);
+	teken_assert(p->tp_col < t->t_winsize.tp_col);
+
+	t->t_funcs->tf_combine(t->t_softc, p, c);
+}
+
 static inline void
 teken_funcs_fill(teken_t *t, const teken_rect_t *r,
     const teken_char_t c, const teken_attr_t *a)
@@ -152,7 +193,7 @@ teken_init(teken_t *t, const teken_funcs_t *tf, void *softc)
 	t->t_funcs = tf;
 	t->t_softc = softc;
 
-	t->t_nextstate = teken_state_init;
+	t->t_state = TEKEN_S_INIT;
 	t->t_stateflags = 0;
 	t->t_utf8_left = 0;
 
@@ -186,6 +227,10 @@ teken_input_char(teken_t *t, teken_char_t c)
 		}
 	}
 
+	/* Only printable characters get joined after a ZWJ. */
+	if (c < 0x20 || c == 0x7f)
+		t->t_stateflags &= ~TS_ZWJ;
+
 	switch (c) {
 	case '\0':
 		break;
@@ -204,13 +249,13 @@ teken_input_char(teken_t *t, teken_char_t c)
 		break;
 	case '\x0E':
 		if (t->t_stateflags & TS_CONS25)
-			t->t_nextstate(t, c);
+			teken_state_input(t, c);
 		else
 			t->t_curscs = 1;
 		break;
 	case '\x0F':
 		if (t->t_stateflags & TS_CONS25)
-			t->t_nextstate(t, c);
+			teken_state_input(t, c);
 		else
 			t->t_curscs = 0;
 		break;
@@ -221,7 +266,7 @@ teken_input_char(teken_t *t, teken_char_t c)
 		teken_subr_horizontal_tab(t);
 		break;
 	default:
-		t->t_nextstate(t, c);
+		teken_state_input(t, c);
 		break;
 	}
 
@@ -241,48 +286,217 @@ teken_input_char(teken_t *t, teken_char_t c)
 	    t->t_originreg.ts_end == t->t_winsize.tp_row));
 }
 
+/*
+ * Start a UTF-8 sequence with lead byte c.  Returns the number of
+ * continuation bytes, with the bounds of the first one in lo and hi,
+ * or 0 if c cannot start a sequence.
+ */
+static inline unsigned int
+teken_utf8_lead(unsigned char c, teken_char_t *partial, unsigned char *lo,
+    unsigned char *hi)
+{
+
+	*lo = 0x80;
+	*hi = 0xbf;
+	if (c >= 0xc2 && c <= 0xdf) {
+		*partial = c & 0x1f;
+		return (1);
+	} else if (c >= 0xe0 && c <= 0xef) {
+		*partial = c & 0x0f;
+		if (c == 0xe0)
+			*lo = 0xa0;	/* Overlong. */
+		else if (c == 0xed)
+			*hi = 0x9f;	/* Surrogates. */
+		return (2);
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		*partial = c & 0x07;
+		if (c == 0xf0)
+			*lo = 0x90;	/* Overlong. */
+		else if (c == 0xf4)
+			*hi = 0x8f;	/* Beyond U+10FFFF. */
+		return (3);
+	}
+	return (0);
+}
+
 static void
 teken_input_byte(teken_t *t, unsigned char c)
 {
 
+	if (t->t_stateflags & TS_8BIT) {
+		t->t_utf8_left = 0;
+		teken_input_char(t, c);
+		return;
+	}
+
 	/*
-	 * UTF-8 handling.
+	 * UTF-8 handling.  Malformed sequences are replaced by U+FFFD,
+	 * one for each maximal prefix of a valid sequence.
 	 */
-	if ((c & 0x80) == 0x00 || t->t_stateflags & TS_8BIT) {
-		/* One-byte sequence. */
+	if (t->t_utf8_left > 0) {
+		if (c >= t->t_utf8_lo && c <= t->t_utf8_hi) {
+			t->t_utf8_partial = (t->t_utf8_partial << 6) |
+			    (c & 0x3f);
+			t->t_utf8_lo = 0x80;
+			t->t_utf8_hi = 0xbf;
+			if (--t->t_utf8_left == 0) {
+				teken_printf("Got UTF-8 char %x\n",
+				    t->t_utf8_partial);
+				teken_input_char(t, t->t_utf8_partial);
+			}
+			return;
+		}
+		/* Truncated sequence. */
 		t->t_utf8_left = 0;
+		teken_input_char(t, REPLACEMENT);
+	}
+	if ((c & 0x80) == 0x00) {
+		/* One-byte sequence. */
 		teken_input_char(t, c);
-	} else if ((c & 0xe0) == 0xc0) {
-		/* Two-byte sequence. */
-		t->t_utf8_left = 1;
-		t->t_utf8_partial = c & 0x1f;
-	} else if ((c & 0xf0) == 0xe0) {
-		/* Three-byte sequence. */
-		t->t_utf8_left = 2;
-		t->t_utf8_partial = c & 0x0f;
-	} else if ((c & 0xf8) == 0xf0) {
-		/* Four-byte sequence. */
-		t->t_utf8_left = 3;
-		t->t_utf8_partial = c & 0x07;
-	} else if ((c & 0xc0) == 0x80) {
+	} else {
+		t->t_utf8_left = teken_utf8_lead(c, &t->t_utf8_partial,
+		    &t->t_utf8_lo, &t->t_utf8_hi);
+		/* Stray continuation byte or invalid lead byte. */
 		if (t->t_utf8_left == 0)
-			return;
-		t->t_utf8_left--;
-		t->t_utf8_partial = (t->t_utf8_partial << 6) | (c & 0x3f);
-		if (t->t_utf8_left == 0) {
-			teken_printf("Got UTF-8 char %x\n", t->t_utf8_partial);
-			teken_input_char(t, t->t_utf8_partial);
+			teken_input_char(t, REPLACEMENT);
+	}
+}
+
+/*
+ * Decode the run of printable characters at the start of buf into out,
+ * with the same result as teken_input_byte().  Stops at control
+ * characters, when *nout characters have been stored, and before a
+ * sequence that is cut off by the end of buf, which teken_input_byte()
+ * then carries over into the next call.  Returns the number of bytes
+ * consumed, and the number of characters in *nout.
+ */
+static size_t
+teken_utf8_decode(const unsigned char *buf, size_t len, teken_char_t *out,
+    size_t *nout)
+{
+	size_t i = 0, o = 0, max = *nout, end;
+	unsigned int n, k;
+	unsigned char c, lo, hi;
+	teken_char_t cp;
+#ifdef __SSE2__
+	const __m128i lo7 = _mm_set1_epi8(0x1f), hi7 = _mm_set1_epi8(0x7f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, w;
+#endif
+
+	while (i < len && o < max) {
+		end = len;
+#ifdef __SSE2__
+		/*
+		 * Widen blocks of printable ASCII 16 bytes at a time.
+		 * Bytes >= 0x80 are negative, and thus fail the first
+		 * compare.  Other blocks are decoded below.
+		 */
+		if (i + 16 <= len && o + 16 <= max) {
+			v = _mm_loadu_si128((const __m128i *)&buf[i]);
+			if (_mm_movemask_epi8(_mm_and_si128(
+			    _mm_cmpgt_epi8(v, lo7),
+			    _mm_cmplt_epi8(v, hi7))) == 0xffff) {
+				w = _mm_unpacklo_epi8(v, zero);
+				_mm_storeu_si128((__m128i *)&out[o],
+				    _mm_unpacklo_epi16(w, zero));
+				_mm_storeu_si128((__m128i *)&out[o + 4],
+				    _mm_unpackhi_epi16(w, zero));
+				w = _mm_unpackhi_epi8(v, zero);
+				_mm_storeu_si128((__m128i *)&out[o + 8],
+				    _mm_unpacklo_epi16(w, zero));
+				_mm_storeu_si128((__m128i *)&out[o + 12],
+				    _mm_unpackhi_epi16(w, zero));
+				i += 16;
+				o += 16;
+				continue;
+			}
+			end = i + 16;
+		}
+#endif
+		while (i < end && o < max) {
+			c = buf[i];
+			if (c < 0x80) {
+				if (c < 0x20 || c == 0x7f)
+					goto done;
+				out[o++] = c;
+				i++;
+				continue;
+			}
+			n = teken_utf8_lead(c, &cp, &lo, &hi);
+			for (k = 0; k < n; k++) {
+				if (i + 1 + k == len)
+					goto done;
+				c = buf[i + 1 + k];
+				if (c < lo || c > hi)
+					break;
+				cp = (cp << 6) | (c & 0x3f);
+				lo = 0x80;
+				hi = 0xbf;
+			}
+			out[o++] = n > 0 && k == n ? cp : REPLACEMENT;
+			i += 1 + k;
 		}
 	}
+done:
+	*nout = o;
+	return (i);
 }
 
 void
 teken_input(teken_t *t, const void *buf, size_t len)
 {
-	const char *c = buf;
+	const unsigned char *c = buf;
+	teken_char_t cbuf[256];
+	size_t n, k;
 
-	while (len-- > 0)
+	while (len > 0) {
+		/*
+		 * Fast path for printable characters in the ground state,
+		 * which are decoded a chunk at a time.
+		 */
+		if (t->t_state == TEKEN_S_INIT &&
+		    t->t_utf8_left == 0 &&
+		    (t->t_stateflags & (TS_INSERT|TS_8BIT|TS_CONS25|
+		    TS_INSTRING|TS_ZWJ)) == 0 &&
+		    t->t_scs[t->t_curscs] == teken_scs_us_ascii) {
+			k = sizeof(cbuf) / sizeof(cbuf[0]);
+			n = teken_utf8_decode(c, len, cbuf, &k);
+			if (n > 0) {
+				/*
+				 * One byte per character means ASCII or
+				 * U+FFFD, which all have a width of 1.
+				 */
+				if (k == n)
+					teken_subr_printable_run(t, cbuf, k);
+				else
+					teken_subr_character_run(t, cbuf, k);
+				c += n;
+				len -= n;
+				continue;
+			}
+		}
+		/*
+		 * Inside an escape sequence, printable characters go
+		 * straight to the state machine.
+		 */
+		if (t->t_state != TEKEN_S_INIT && t->t_utf8_left == 0 &&
+		    (t->t_stateflags & TS_INSTRING) == 0) {
+			n = 0;
+			while (n < len && c[n] >= 0x20 && c[n] < 0x7f) {
+				teken_state_input(t, c[n++]);
+				if (t->t_state == TEKEN_S_INIT)
+					break;
+			}
+			if (n > 0) {
+				c += n;
+				len -= n;
+				continue;
+			}
+		}
 		teken_input_byte(t, *c++);
+		len--;
+	}
 }
 
 const teken_pos_t *
@@ -390,10 +604,10 @@ teken_set_cons25(teken_t *t)
  */
 
 static void
-teken_state_switch(teken_t *t, teken_state_t *s)
+teken_state_switch(teken_t *t, unsigned int s)
 {
 
-	t->t_nextstate = s;
+	t->t_state = s;
 	t->t_curnum = 0;
 	t->t_stateflags |= TS_FIRSTDIGIT;
 }
@@ -424,7 +638,7 @@ teken_state_numbers(teken_t *t, teken_char_t c)
 
 		/* Only allow a limited set of arguments. */
 		if (++t->t_curnum == T_NUMSIZE) {
-			teken_state_switch(t, teken_state_init);
+			teken_state_switch(t, TEKEN_S_INIT);
 			return (1);
 		}
 
@@ -449,7 +663,12 @@ teken_256to8(teken_color_t c)
 {
 	unsigned int r, g, b;
 
-	if (c < 16) {
+	if (c & TC_RGB) {
+		/* Reduce to the 6x6x6 color cube. */
+		r = ((c >> 16) & 0xff) * 6 / 256;
+		g = ((c >> 8) & 0xff) * 6 / 256;
+		b = (c & 0xff) * 6 / 256;
+	} else if (c < 16) {
 		/* Traditional color indices. */
 		return (c % 8);
 	} else if (c >= 244) {
@@ -458,14 +677,14 @@ teken_256to8(teken_color_t c)
 	} else if (c >= 232) {
 		/* Lower grayscale colors. */
 		return (TC_BLACK);
+	} else {
+		/* Convert to RGB. */
+		c -= 16;
+		b = c % 6;
+		g = (c / 6) % 6;
+		r = c / 36;
 	}
 
-	/* Convert to RGB. */
-	c -= 16;
-	b = c % 6;
-	g = (c / 6) % 6;
-	r = c / 36;
-
 	if (r < g) {
 		/* Possibly green. */
 		if (g < b)
@@ -584,3 +803,33 @@ teken_get_sequence(teken_t *t, unsigned int k)
 }
 
 #include "teken_state.h"
+
+static void
+teken_state_input(teken_t *t, teken_char_t c)
+{
+	unsigned int s, a;
+
+	s = t->t_state;
+	a = teken_dfa[s][c < 128 ? teken_dfa_class[c] : 0];
+	if (a == TEKEN_A_NUMBER) {
+		teken_state_numbers(t, c);
+		return;
+	}
+	/* Finish off the last numeric argument. */
+	if (teken_dfa_numbers[s])
+		teken_state_numbers(t, c);
+
+	if (a >= TEKEN_A_CMD) {
+		teken_state_exec(t, a - TEKEN_A_CMD);
+	} else if (a >= TEKEN_A_STATE) {
+		teken_state_switch(t, a - TEKEN_A_STATE);
+		return;
+	} else if (s == TEKEN_S_INIT) {
+		teken_subr_regular_character(t, c);
+		return;
+	} else {
+		teken_printf("Unsupported sequence in state %u: %u\n", s,
+		    (unsigned int)c);
+	}
+	teken_state_switch(t, TEKEN_S_INIT);
+}
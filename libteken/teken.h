@@ -46,7 +46,7 @@ typedef unsigned char teken_format_t;
 #define	TF_BLINK	0x04	/* Blinking character. */
 #define	TF_REVERSE	0x08	/* Reverse rendered character. */
 #define	TF_CJK_RIGHT	0x10	/* Right-hand side of CJK character. */
-typedef unsigned char teken_color_t;
+typedef uint32_t teken_color_t;
 #define	TC_BLACK	0
 #define	TC_RED		1
 #define	TC_GREEN	2
@@ -56,6 +56,7 @@ typedef unsigned char teken_color_t;
 #define	TC_CYAN		6
 #define	TC_WHITE	7
 #define	TC_NCOLORS	8
+#define	TC_RGB		0x01000000	/* 24-bit color, TC_RGB | 0xrrggbb. */
 
 typedef struct {
 	teken_unit_t	tp_row;
@@ -77,8 +78,6 @@ typedef struct {
 
 typedef struct __teken teken_t;
 
-typedef void teken_state_t(teken_t *, teken_char_t);
-
 /*
  * Drawing routines supplied by the user.
  */
@@ -101,6 +100,9 @@ typedef void tf_param_t(void *, int, unsigned int);
 #define	TP_SETBELLPD_DURATION(pd)	((pd) & 0xffff)
 #define	TP_MOUSE	6
 typedef void tf_respond_t(void *, const void *, size_t);
+typedef void tf_putchars_t(void *, const teken_pos_t *, const teken_char_t *,
+    unsigned int, const teken_attr_t *);
+typedef void tf_combine_t(void *, const teken_pos_t *, teken_char_t);
 
 typedef struct {
 	tf_bell_t	*tf_bell;
@@ -110,6 +112,8 @@ typedef struct {
 	tf_copy_t	*tf_copy;
 	tf_param_t	*tf_param;
 	tf_respond_t	*tf_respond;
+	tf_putchars_t	*tf_putchars;	/* Optional. */
+	tf_combine_t	*tf_combine;	/* Optional. */
 } teken_funcs_t;
 
 typedef teken_char_t teken_scs_t(teken_t *, teken_char_t);
@@ -122,10 +126,10 @@ struct __teken {
 	const teken_funcs_t *t_funcs;
 	void		*t_softc;
 
-	teken_state_t	*t_nextstate;
+	unsigned int	 t_state;
 	unsigned int	 t_stateflags;
 
-#define T_NUMSIZE	8
+#define T_NUMSIZE	16
 	unsigned int	 t_nums[T_NUMSIZE];
 	unsigned int	 t_curnum;
 
@@ -147,6 +151,7 @@ struct __teken {
 
 	unsigned int	 t_utf8_left;
 	teken_char_t	 t_utf8_partial;
+	unsigned char	 t_utf8_lo, t_utf8_hi;
 
 	unsigned int	 t_curscs;
 	teken_scs_t	*t_saved_curscs;
@@ -806,6 +806,107 @@ teken_subr_do_putchar(teken_t *t, const teken_pos_t *tp, teken_char_t c,
 	}
 }
 
+static void
+teken_subr_do_putchars(teken_t *t, const teken_pos_t *tp,
+    const teken_char_t *c, unsigned int n)
+{
+
+	teken_funcs_putchars(t, tp, c, n, &t->t_curattr);
+}
+
+/*
+ * Print a run of characters with a width of 1, with the same effect as
+ * calling teken_subr_regular_character() for each of them, outside of
+ * insert mode, 8-bit mode and cons25 mode.
+ */
+static void
+teken_subr_printable_run(teken_t *t, const teken_char_t *c, size_t n)
+{
+	teken_pos_t tp;
+	unsigned int k, space;
+
+	while (n > 0) {
+		if (t->t_stateflags & TS_AUTOWRAP &&
+		    t->t_stateflags & TS_WRAPPED &&
+		    t->t_cursor.tp_col + 1 == t->t_winsize.tp_col) {
+			/* Perform line wrapping. */
+			if (t->t_cursor.tp_row == t->t_scrollreg.ts_end - 1) {
+				teken_subr_do_scroll(t, 1);
+			} else if (t->t_cursor.tp_row + 1 ==
+			    t->t_winsize.tp_row) {
+				/*
+				 * Corner case: outside scrolling region,
+				 * but at the bottom of the screen. All the
+				 * characters end up in the last cell.
+				 */
+				teken_subr_do_putchars(t, &t->t_cursor,
+				    &c[n - 1], 1);
+				break;
+			} else {
+				t->t_cursor.tp_row++;
+			}
+			t->t_cursor.tp_col = 0;
+			t->t_stateflags &= ~TS_WRAPPED;
+		}
+
+		space = t->t_winsize.tp_col - t->t_cursor.tp_col;
+		if (!(t->t_stateflags & TS_AUTOWRAP) && n > space) {
+			/*
+			 * Without autowrap, the characters which don't fit
+			 * all end up in the last column.
+			 */
+			teken_subr_do_putchars(t, &t->t_cursor, c, space - 1);
+			tp.tp_row = t->t_cursor.tp_row;
+			tp.tp_col = t->t_winsize.tp_col - 1;
+			teken_subr_do_putchars(t, &tp, &c[n - 1], 1);
+			t->t_cursor.tp_col = t->t_winsize.tp_col - 1;
+			t->t_stateflags |= TS_WRAPPED;
+			break;
+		}
+
+		k = MIN(n, space);
+		teken_subr_do_putchars(t, &t->t_cursor, c, k);
+		c += k;
+		n -= k;
+
+		t->t_cursor.tp_col += k;
+		if (t->t_cursor.tp_col >= t->t_winsize.tp_col) {
+			t->t_stateflags |= TS_WRAPPED;
+			t->t_cursor.tp_col = t->t_winsize.tp_col - 1;
+		} else {
+			t->t_stateflags &= ~TS_WRAPPED;
+		}
+	}
+
+	teken_funcs_cursor(t);
+}
+
+/*
+ * Attach a zero-width character to the last printed one, which is left
+ * of the cursor, or under it after printing in the last column.  After
+ * a zero-width joiner, the next character is attached as well.  Returns
+ * whether the character was attached.
+ */
+static int
+teken_subr_combining_character(teken_t *t, teken_char_t c)
+{
+	teken_pos_t tp;
+
+	t->t_stateflags &= ~TS_ZWJ;
+	if (t->t_funcs->tf_combine == NULL)
+		return (0);
+	tp = t->t_cursor;
+	if (!(t->t_stateflags & TS_WRAPPED)) {
+		if (tp.tp_col == 0)
+			return (0);
+		tp.tp_col--;
+	}
+	teken_funcs_combine(t, &tp, c);
+	if (c == 0x200d)
+		t->t_stateflags |= TS_ZWJ;
+	return (1);
+}
+
 static void
 teken_subr_regular_character(teken_t *t, teken_char_t c)
 {
@@ -819,8 +920,14 @@ teken_subr_regular_character(teken_t *t, teken_char_t c)
 	} else {
 		c = teken_scs_process(t, c);
 		width = teken_wcwidth(c);
-		/* XXX: Don't process zero-width characters yet. */
-		if (width <= 0)
+		if (width == 0) {
+			teken_subr_combining_character(t, c);
+			return;
+		}
+		if (width < 0)
+			return;
+		if (t->t_stateflags & TS_ZWJ &&
+		    teken_subr_combining_character(t, c))
 			return;
 	}
 
@@ -893,6 +1000,34 @@ teken_subr_regular_character(teken_t *t, teken_char_t c)
 	teken_funcs_cursor(t);
 }
 
+/*
+ * Print a run of decoded characters, passing the characters with a
+ * width of 1 to teken_subr_printable_run() in bulk.  A character after
+ * a zero-width joiner may have to be joined instead.
+ */
+static void
+teken_subr_character_run(teken_t *t, const teken_char_t *c, size_t n)
+{
+	size_t i;
+
+	while (n > 0) {
+		i = 0;
+		if (!(t->t_stateflags & TS_ZWJ)) {
+			while (i < n &&
+			    (c[i] < 0x80 || teken_wcwidth(c[i]) == 1))
+				i++;
+		}
+		if (i > 0) {
+			teken_subr_printable_run(t, c, i);
+		} else {
+			teken_subr_regular_character(t, c[0]);
+			i = 1;
+		}
+		c += i;
+		n -= i;
+	}
+}
+
 static void
 teken_subr_reset_dec_mode(teken_t *t, unsigned int cmd)
 {
@@ -1117,6 +1252,14 @@ teken_subr_set_mode(teken_t *t, unsigned int cmd)
 	}
 }
 
+static teken_color_t
+teken_rgb(const unsigned int rgb[3])
+{
+
+	return (TC_RGB | MIN(rgb[0], 255) << 16 | MIN(rgb[1], 255) << 8 |
+	    MIN(rgb[2], 255));
+}
+
 static void
 teken_subr_set_graphic_rendition(teken_t *t, unsigned int ncmds,
     unsigned int cmds[])
@@ -1170,11 +1313,16 @@ teken_subr_set_graphic_rendition(teken_t *t, unsigned int ncmds,
 		case 37: /* Set foreground color: white */
 			t->t_curattr.ta_fgcolor = n - 30;
 			break;
-		case 38: /* Set foreground color: 256 color mode */
-			if (i + 2 >= ncmds || cmds[i + 1] != 5)
-				continue;
-			t->t_curattr.ta_fgcolor = cmds[i + 2];
-			i += 2;
+		case 38: /* Set foreground color: 256 color or RGB mode */
+			if (i + 2 < ncmds && cmds[i + 1] == 5) {
+				if (cmds[i + 2] < 256)
+					t->t_curattr.ta_fgcolor = cmds[i + 2];
+				i += 2;
+			} else if (i + 4 < ncmds && cmds[i + 1] == 2) {
+				t->t_curattr.ta_fgcolor =
+				    teken_rgb(&cmds[i + 2]);
+				i += 4;
+			}
 			break;
 		case 39: /* Set default foreground color. */
 			t->t_curattr.ta_fgcolor = t->t_defattr.ta_fgcolor;
@@ -1189,11 +1337,16 @@ teken_subr_set_graphic_rendition(teken_t *t, unsigned int ncmds,
 		case 47: /* Set background color: white */
 			t->t_curattr.ta_bgcolor = n - 40;
 			break;
-		case 48: /* Set background color: 256 color mode */
-			if (i + 2 >= ncmds || cmds[i + 1] != 5)
-				continue;
-			t->t_curattr.ta_bgcolor = cmds[i + 2];
-			i += 2;
+		case 48: /* Set background color: 256 color or RGB mode */
+			if (i + 2 < ncmds && cmds[i + 1] == 5) {
+				if (cmds[i + 2] < 256)
+					t->t_curattr.ta_bgcolor = cmds[i + 2];
+				i += 2;
+			} else if (i + 4 < ncmds && cmds[i + 1] == 2) {
+				t->t_curattr.ta_bgcolor =
+				    teken_rgb(&cmds[i + 2]);
+				i += 4;
+			}
 			break;
 		case 49: /* Set default background color. */
 			t->t_curattr.ta_bgcolor = t->t_defattr.ta_bgcolor;
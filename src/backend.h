@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_	0
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct event_base;
+
+/* A mapped XRGB8888 framebuffer, pitch is in bytes */
+struct framebuffer {
+	void *plane;
+	uint32_t pitch;
+	uint32_t width, height;
+	void *priv;
+};
+
+/*
+ * Output backends. flip() and wait_vblank() return 0 when the request was
+ * queued, the backend then calls handle_page_flip() or handle_vblank()
+ * from the event loop once it completes. flip() fails with errno EBUSY if
+ * it should be retried after the next vblank.
+ */
+struct backend {
+	const char *name;
+	int	(*init)(void);
+	void	(*finish)(void);
+	int	(*allocfb)(struct framebuffer *);
+	void	(*destroyfb)(struct framebuffer *);
+	int	(*show)(struct framebuffer *);
+	int	(*hide)(void);
+	int	(*flip)(struct framebuffer *);
+	int	(*wait_vblank)(void);
+	void	(*set_dpms)(bool);
+	int	(*attach)(struct event_base *);
+	void	(*detach)(void);
+};
+
+extern const struct backend drm_backend;
+extern const struct backend headless_backend;
+
+/* headless backend settings */
+extern uint32_t headless_width, headless_height;
+extern const char *headless_dump;
+
+void	handle_vblank(void);
+void	handle_page_flip(void);
+
+#endif /* !_BACKEND_H_ */
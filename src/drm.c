@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+#include <sys/param.h>
+
+#include <libkms/libkms.h>
+#include <drm_fourcc.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <event2/event.h>
+
+#include "backend.h"
+
+struct drm_framebuffer {
+	struct kms_bo *bo;
+	unsigned handles[4], pitches[4], offsets[4];
+	uint32_t fbid;
+};
+
+struct drm_state {
+	int fd;
+	struct kms_driver *kms;
+	drmModeCrtcPtr crtc;
+	drmModeConnectorPtr conn;
+	int oldbuffer_id;
+	int dpms_mode;
+	struct event_base *evbase;
+	struct event *ev;
+};
+
+static struct drm_state gfxstate;
+
+static int
+drm_backend_init(void)
+{
+	struct drm_state *dst = &gfxstate;
+	drmModeResPtr res;
+	drmModeEncoderPtr enc;
+	int fd, i;
+
+	fd = drmOpen("i915", NULL);
+	if (fd < 0) {
+		perror("drmOpen(\"i915\", NULL)");
+		fd = drmOpen("radeon", NULL);
+		if (fd < 0) {
+			perror("drmOpen(\"radeon\", NULL)");
+			return 1;
+		}
+	}
+
+	dst->fd = fd;
+	dst->dpms_mode = DRM_MODE_DPMS_ON;
+
+	res = drmModeGetResources(fd);
+	if (res == NULL) {
+		warn("drmModeGetResources");
+		return 1;
+	}
+#if 0
+	printf("count_fbs: %d, count_crtcs: %d, count_connectors: %d, "
+	    "min_width: %u, max_width: %u, min_height: %u, max_height: %u\n",
+	    res->count_fbs, res->count_crtcs, res->count_connectors,
+	    res->min_width, res->max_width, res->min_height, res->max_height);
+#endif
+
+	/* First take the first display output which is connected */
+	for (i = 0; i < res->count_connectors; ++i) {
+		dst->conn = drmModeGetConnector(fd, res->connectors[i]);
+		if(dst->conn->connection == DRM_MODE_CONNECTED)
+			break;
+	}
+	if (res->count_connectors <= 0) {
+		warnx("No Monitor connected");
+		return 1;
+	}
+#if 0
+	printf("dst->conn->mmWidth: %u\n", dst->conn->mmWidth);
+	printf("dst->conn->mmHeight: %u\n", dst->conn->mmHeight);
+	printf("dst->conn->connector_id = %u\n", dst->conn->connector_id);
+	printf("dst->conn->encoder_id = %u\n", dst->conn->encoder_id);
+	printf("dst->conn->connector_type = %u\n", dst->conn->connector_type);
+	printf("dst->conn->connector_type_id = %u\n", dst->conn->connector_type_id);
+	printf("dst->conn->count_modes = %u\n", dst->conn->count_modes);
+	printf("dst->conn->count_props = %u\n", dst->conn->count_props);
+	printf("dst->conn->count_encoders = %u\n", dst->conn->count_encoders);
+	for (i = 0; i < dst->conn->count_encoders; i++)
+		printf("gfxstate.conn->encoders[%d] = %u\n", i, gfxstate.conn->encoders[i]);
+#endif
+
+	/* Using only the first encoder in gfxstate.conn->encoders for now */
+	if (gfxstate.conn->count_encoders == 0) {
+		warnx("No encoders on this conection\n");
+		return 1;
+	} else if (gfxstate.conn->count_encoders > 1) {
+		printf("Using the first encoder in gfxstate.conn->encoders\n");
+	}
+	enc = drmModeGetEncoder(fd, gfxstate.conn->encoders[0]);
+#if 0
+	printf("enc->encoder_id = %u\n", enc->encoder_id);
+	printf("enc->encoder_type = %u\n", enc->encoder_type);
+	printf("enc->crtc_id = %u\n", enc->crtc_id);
+	printf("enc->possible_crtcs = %u\n", enc->possible_crtcs);
+	printf("enc->possible_clones = %u\n", enc->possible_clones);
+#endif
+
+	/*
+	 * Just use the index of the lowest bit set in enc->possible_crtcs
+	 * to select our crtc from res->crtcs.
+	 */
+	for (i = 0; i < MAX(32, res->count_crtcs); i++) {
+		if (enc->possible_crtcs & (1U << i)) {
+			gfxstate.crtc = drmModeGetCrtc(fd, res->crtcs[i]);
+			if (gfxstate.crtc != NULL)
+				break;
+		}
+	}
+	if (i == res->count_crtcs) {
+		warnx("No usable crtc found in enc->possible_crtcs\n");
+		return 1;
+	}
+
+	drmModeFreeResources(res);
+	drmModeFreeEncoder(enc);
+
+#if 0
+	printf("gfxstate.crtc->crtc_id = %u\n", gfxstate.crtc->crtc_id);
+	printf("gfxstate.crtc->buffer_id = %u\n", gfxstate.crtc->buffer_id);
+	printf("gfxstate.crtc->width/height = %ux%u\n", gfxstate.crtc->width, gfxstate.crtc->height);
+	printf("gfxstate.crtc->mode_valid = %u\n", gfxstate.crtc->mode_valid);
+	printf("x: %u, y: %u\n", crtc->x, gfxstate.crtc->y);
+#endif
+	gfxstate.oldbuffer_id = gfxstate.crtc->buffer_id;
+
+	/* Just use the first display mode given in gfxstate.conn->modes */
+	/* XXX Allow the user to override the mode via a commandline argument */
+	if (gfxstate.conn->count_modes == 0) {
+		warnx("No display mode specified in gfxstate.conn->modes\n");
+		return 1;
+	}
+	gfxstate.crtc->mode = gfxstate.conn->modes[0];
+#if 0
+	printf("Display mode:\n");
+	printf("clock: %u\n", gfxstate.crtc->mode.clock);
+	printf("vrefresh: %u\n", gfxstate.crtc->mode.vrefresh);
+	printf("hdisplay: %u\n", gfxstate.crtc->mode.hdisplay);
+	printf("hsync_start: %u hsync_end: %u\n",
+	    gfxstate.crtc->mode.hsync_start, gfxstate.crtc->mode.hsync_end);
+	printf("htotal: %u\n", gfxstate.crtc->mode.htotal);
+	printf("hskew: %u\n", gfxstate.crtc->mode.hskew);
+	printf("vdisplay: %u\n", gfxstate.crtc->mode.vdisplay);
+	printf("vsync_start: %u vsync_end: %u\n",
+	    gfxstate.crtc->mode.vsync_start, gfxstate.crtc->mode.vsync_end);
+	printf("vtotal: %u\n", gfxstate.crtc->mode.vtotal);
+	printf("vscan: %u\n", gfxstate.crtc->mode.vscan);
+	printf("flags: %u\n", gfxstate.crtc->mode.flags);
+	printf("type: %u\n", gfxstate.crtc->mode.type);
+#endif
+
+	kms_create(dst->fd, &dst->kms);
+
+	return 0;
+}
+
+static void
+drm_backend_finish(void)
+{
+	struct drm_state *dst = &gfxstate;
+
+	kms_destroy(&dst->kms);
+	drmModeFreeConnector(dst->conn);
+	drmModeFreeCrtc(dst->crtc);
+	drmClose(dst->fd);
+}
+
+static int
+drm_backend_allocfb(struct framebuffer *fbp)
+{
+	struct drm_state *dst = &gfxstate;
+	struct drm_framebuffer *fb;
+
+	fb = calloc(1, sizeof(*fb));
+	if (fb == NULL)
+		return 1;
+	fbp->priv = fb;
+	fbp->width = dst->crtc->mode.hdisplay;
+	fbp->height = dst->crtc->mode.vdisplay;
+
+	unsigned bo_attribs[] = {
+		KMS_WIDTH,	fbp->width,
+		KMS_HEIGHT,	fbp->height,
+		KMS_BO_TYPE,	KMS_BO_TYPE_SCANOUT_X8R8G8B8,
+		KMS_TERMINATE_PROP_LIST
+	};
+	kms_bo_create(dst->kms, bo_attribs, &fb->bo);
+	kms_bo_get_prop(fb->bo, KMS_HANDLE, &fb->handles[0]);
+	kms_bo_get_prop(fb->bo, KMS_PITCH, &fb->pitches[0]);
+#if 0
+	printf("fb->pitches[0] = %u\n", fb->pitches[0]);
+	printf("fb->handles[0] = %u\n", fb->handles[0]);
+#endif
+	fb->offsets[0] = 0;
+	kms_bo_map(fb->bo, &fbp->plane);
+	fbp->pitch = fb->pitches[0];
+	drmModeAddFB2(dst->fd, fbp->width, fbp->height, DRM_FORMAT_XRGB8888,
+	    fb->handles, fb->pitches, fb->offsets,
+	    &fb->fbid, 0);
+	return 0;
+}
+
+static void
+drm_backend_destroyfb(struct framebuffer *fbp)
+{
+	struct drm_state *dst = &gfxstate;
+	struct drm_framebuffer *fb = fbp->priv;
+
+	drmModeRmFB(dst->fd, fb->fbid);
+	kms_bo_unmap(fb->bo);
+	kms_bo_destroy(&fb->bo);
+	free(fb);
+	fbp->priv = NULL;
+}
+
+static int
+drm_backend_show(struct framebuffer *fbp)
+{
+	struct drm_state *dst = &gfxstate;
+	struct drm_framebuffer *fb = fbp->priv;
+	int ret = 0;
+
+	if (drmSetMaster(dst->fd) != 0) {
+		perror("drmSetMaster");
+		ret = 1;
+	}
+	if (drmModeSetCrtc(dst->fd, dst->crtc->crtc_id, fb->fbid, 0, 0,
+	    &dst->conn->connector_id, 1, &dst->crtc->mode) != 0) {
+		perror("drmModeSetCrtc");
+		ret = 1;
+	}
+	return ret;
+}
+
+static int
+drm_backend_hide(void)
+{
+	struct drm_state *dst = &gfxstate;
+	int ret = 0;
+
+	if (drmModeSetCrtc(dst->fd, dst->crtc->crtc_id, dst->oldbuffer_id,
+	    0, 0, &dst->conn->connector_id, 1, &dst->crtc->mode) != 0) {
+		perror("drmModeSetCrtc");
+		ret = 1;
+	}
+	if (drmDropMaster(dst->fd) != 0) {
+		perror("drmDropMaster");
+		ret = 1;
+	}
+	return ret;
+}
+
+static int
+drm_backend_flip(struct framebuffer *fbp)
+{
+	struct drm_state *dst = &gfxstate;
+	struct drm_framebuffer *fb = fbp->priv;
+
+	if (drmModePageFlip(dst->fd, dst->crtc->crtc_id, fb->fbid,
+	    DRM_MODE_PAGE_FLIP_EVENT, NULL) != 0) {
+		if (errno != EBUSY)
+			warn("drmModePageFlip");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+drm_backend_wait_vblank(void)
+{
+	drmVBlank req = {
+		.request.type = _DRM_VBLANK_RELATIVE | _DRM_VBLANK_EVENT,
+		.request.sequence = 1,
+		.request.signal = 0
+	};
+
+	return drmWaitVBlank(gfxstate.fd, &req);
+}
+
+static void
+drm_backend_set_dpms(bool on)
+{
+	struct drm_state *dst = &gfxstate;
+	int i, level;
+	drmModePropertyPtr prop = NULL, props;
+
+	level = on ? DRM_MODE_DPMS_ON : DRM_MODE_DPMS_SUSPEND;
+	if (level == dst->dpms_mode)
+		return;
+
+	for (i = 0; i < dst->conn->count_props; i++) {
+		props = drmModeGetProperty(dst->fd, dst->conn->props[i]);
+		if (props == NULL)
+			continue;
+
+		if (strcmp(props->name, "DPMS") == 0) {
+			prop = props;
+			break;
+		}
+		drmModeFreeProperty(props);
+	}
+
+	if (prop == NULL)
+		return;
+
+	drmModeConnectorSetProperty(dst->fd, dst->conn->connector_id,
+	    prop->prop_id, level);
+	drmModeFreeProperty(prop);
+	dst->dpms_mode = level;
+}
+
+static void
+drm_vblank_handler(int fd __unused, unsigned int sequence __unused,
+    unsigned int tv_sec __unused, unsigned int tv_usec __unused,
+    void *user_data __unused)
+{
+	handle_vblank();
+}
+
+static void
+drm_page_flip_handler(int fd __unused, unsigned int sequence __unused,
+    unsigned int tv_sec __unused, unsigned int tv_usec __unused,
+    void *user_data __unused)
+{
+	handle_page_flip();
+}
+
+static void
+drmread(evutil_socket_t fd __unused, short events __unused, void *arg __unused)
+{
+	drmEventContext evctx = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.vblank_handler = drm_vblank_handler,
+		.page_flip_handler = drm_page_flip_handler
+	};
+
+	if (drmHandleEvent(gfxstate.fd, &evctx) != 0) {
+		warnx("drmHandleEvent failed");
+		event_base_loopbreak(gfxstate.evbase);
+	}
+}
+
+static int
+drm_backend_attach(struct event_base *base)
+{
+	gfxstate.evbase = base;
+	gfxstate.ev = event_new(base, gfxstate.fd,
+	    EV_READ | EV_PERSIST, drmread, NULL);
+	if (gfxstate.ev == NULL)
+		return 1;
+	event_priority_set(gfxstate.ev, 1);
+	event_add(gfxstate.ev, NULL);
+	return 0;
+}
+
+static void
+drm_backend_detach(void)
+{
+	event_del(gfxstate.ev);
+	event_free(gfxstate.ev);
+	gfxstate.ev = NULL;
+}
+
+const struct backend drm_backend = {
+	.name = "drm",
+	.init = drm_backend_init,
+	.finish = drm_backend_finish,
+	.allocfb = drm_backend_allocfb,
+	.destroyfb = drm_backend_destroyfb,
+	.show = drm_backend_show,
+	.hide = drm_backend_hide,
+	.flip = drm_backend_flip,
+	.wait_vblank = drm_backend_wait_vblank,
+	.set_dpms = drm_backend_set_dpms,
+	.attach = drm_backend_attach,
+	.detach = drm_backend_detach
+};
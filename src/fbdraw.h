@@ -43,6 +43,9 @@ typedef struct point dimension;
 typedef struct point vector;
 typedef uint32_t color;
 
+/* Characters which rop32_cell() draws on top of each other, at most */
+#define ROP32_MAXCHARS	8
+
 struct rop_obj *rop32_init(char *, char *, int, int *, int *, bool);
 void rop32_setclip(struct rop_obj *, point, point);
 void rop32_setcontext(struct rop_obj *, void *, uint16_t);
@@ -51,5 +54,8 @@ void rop32_rect(struct rop_obj *, point, dimension, color);
 void rop32_move(struct rop_obj *, point, point, dimension);
 point rop32_char(struct rop_obj *, point, color, color, uint32_t, int);
 point rop32_text(struct rop_obj *, point, color, color, char *, int);
+void rop32_cell(struct rop_obj *, point, color, color, const uint32_t *,
+    unsigned int, int);
+void rop32_setcachesize(struct rop_obj *, size_t);
 
 #endif /* !_FBDRAW_H_ */
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
@@ -38,11 +39,15 @@
 #endif
 #include <libgen.h>
 #include <libutil.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <termios.h>
+#include <time.h>
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef __linux__
 #include <linux/vt.h>
 #else
@@ -50,63 +55,22 @@
 #include <sys/consio.h>
 #endif
 
-#include <libkms/libkms.h>
-#include <drm_fourcc.h>
-
-#include <xf86drm.h>
-#include <xf86drmMode.h>
-
 #include <event2/event.h>
 
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-compose.h>
 
 #include <kbdev.h>
+#include "backend.h"
 #include "fbdraw.h"
-#include "../libteken/teken.h"
-
-struct bufent {
-	teken_char_t ch;
-	teken_attr_t attr;
-	int16_t cursor;
-	int16_t dirty;
-};
-
-void	fbteken_bell(void *thunk);
-void	fbteken_cursor(void *thunk, const teken_pos_t *pos);
-void	fbteken_putchar(void *thunk, const teken_pos_t *pos, teken_char_t ch,
-	    const teken_attr_t *attr);
-void	fbteken_fill(void *thunk, const teken_rect_t *rect, teken_char_t ch,
-	    const teken_attr_t *attr);
-void	fbteken_copy(void *thunk, const teken_rect_t *rect,
-	    const teken_pos_t *pos);
-void	fbteken_param(void *thunk, int param, unsigned int val);
-void	fbteken_respond(void *thunk, const void *arg, size_t sz);
-
-struct drm_framebuffer {
-	struct kms_bo *bo;
-	unsigned handles[4], pitches[4], offsets[4];
-	void *plane;
-	uint32_t width, height;
-	uint32_t fbid;
-};
-
-struct drm_state {
-	int fd;
-	struct kms_driver *kms;
-	drmModeCrtcPtr crtc;
-	drmModeConnectorPtr conn;
-	int oldbuffer_id;
-	int dpms_mode;
-};
+#include "grapheme.h"
+#include "history.h"
+#include "record.h"
+#include "term.h"
 
 static int	handle_term_special_keysym(xkb_keysym_t sym, uint8_t *buf,
 					   size_t len);
 static void	xkb_reset(void);
-static int	drm_backend_show(struct drm_state *dst,
-				 struct drm_framebuffer *fb);
-static int	drm_backend_hide(struct drm_state *dst);
-static void	drm_set_dpms(struct drm_state *dst, int level);
 
 int ttyfd;
 
@@ -120,8 +84,34 @@ struct xkb_compose_state *compstate;
 
 int idle_timeout = 0;	/* idle timeout (in s) */
 
-struct drm_state gfxstate;
-struct drm_framebuffer framebuffer;
+const struct backend *backend = &drm_backend;
+bool headless = false;
+
+/*
+ * Screen updates are drawn into a framebuffer which isn't scanned out, and
+ * then presented with a page flip. With only 1 framebuffer, we draw directly
+ * into the scanned out buffer.
+ */
+#define MAXFBS	3
+struct framebuffer framebuffers[MAXFBS];
+int nfbs = 2;
+int frontfb = 0;	/* currently scanned out */
+int flipfb = -1;	/* page flip to this framebuffer is pending */
+int readyfb = -1;	/* drawn, but not queued for flipping yet */
+int latestfb = 0;	/* has the most recent screen contents */
+
+/*
+ * For each framebuffer, the cells changed since it was last drawn into,
+ * to bring it up to date by copying from the latest framebuffer.
+ */
+struct rowdamage *fbdamage[MAXFBS];
+bool vblankpending = false;
+
+/*
+ * Optional shadow buffer in normal cached memory, which is drawn into
+ * instead of the framebuffers. The damage then gets copied to them.
+ */
+uint32_t *shadowbuf = NULL;
 
 int vtnum;
 #ifndef __linux__
@@ -129,68 +119,17 @@ int initialvtnum;
 #endif
 bool active = true;
 
-struct rop_obj *rop;
-int fnwidth, fnheight;
 struct termios origtios;
 
-teken_funcs_t tek_funcs = {
-	fbteken_bell,
-	fbteken_cursor,
-	fbteken_putchar,
-	fbteken_fill,
-	fbteken_copy,
-	fbteken_param,
-	fbteken_respond,
-};
-
-uint32_t colormap[TC_NCOLORS * 2] = {
-	[TC_BLACK] = 0x00000000,
-	[TC_RED] = 0x00800000,
-	[TC_GREEN] = 0x00008000,
-	[TC_BROWN] = 0x00808000,
-	[TC_BLUE] = 0x000000c0,
-	[TC_MAGENTA] = 0x00800080,
-	[TC_CYAN] = 0x00008080,
-	[TC_WHITE] = 0x00c0c0c0,
-	[TC_BLACK + TC_NCOLORS] = 0x00808080,
-	[TC_RED + TC_NCOLORS] = 0x00ff0000,
-	[TC_GREEN + TC_NCOLORS] = 0x0000ff00,
-	[TC_BROWN + TC_NCOLORS] = 0x00ffff00,
-	[TC_BLUE + TC_NCOLORS] = 0x000000ff,
-	[TC_MAGENTA + TC_NCOLORS] = 0x00ff00ff,
-	[TC_CYAN + TC_NCOLORS] = 0x0000ffff,
-	[TC_WHITE + TC_NCOLORS] = 0x00ffffff,
-};
-
-struct terminal {
-	teken_t tek;
-	struct bufent *buf;
-	teken_pos_t cursorpos;
-	int keypad, showcursor;
-	struct winsize winsz;
-	int amaster;
-	pid_t child;
-};
-
-struct terminal *curterm;
-
 /*
- * XXX organize termbuf as a linear array of pointers to rows, to reduce the
- *     cost of scrolling operations.
+ * Only the current terminal is drawn, the others just update their cell
+ * buffers. Terminals are started when they are first switched to.
  */
-struct bufent *oldbuf;
-uint32_t *dirtybuf, dirtycount = 0;
-int dirtyflag = 0;
-teken_attr_t defattr = {
-	ta_format : 0,
-	ta_fgcolor : TC_WHITE,
-	ta_bgcolor : TC_BLACK,
-};
-teken_attr_t white_defattr = {
-	ta_format : 0,
-	ta_fgcolor : TC_BLACK,
-	ta_bgcolor : TC_WHITE,
-};
+#define MAXTERMS	12
+struct terminal terms[MAXTERMS];
+unsigned int nterms = 1;
+struct terminal *curterm;
+const teken_attr_t *termattr;
 
 struct event_base *evbase;
 struct event *idleev;
@@ -198,6 +137,51 @@ struct event *idleev;
 /* idle timeout */
 struct timeval idletv = { .tv_sec = 0, .tv_usec = 0 };
 
+/*
+ * Output from the pty is parsed in batches of up to readlimit bytes, or
+ * READTIME nanoseconds, before giving other events a chance to run.
+ */
+#define READBUFSIZE	(64 * 1024)
+#define READTIME	4000000
+char readbuf[READBUFSIZE];
+size_t readlimit = 1024 * 1024;
+
+/*
+ * Fast scroll mode (see modelonly) is entered while more output is pending
+ * after a batch. The screen is diffed once the pty goes quiet, or after
+ * maxstale milliseconds.
+ */
+struct timespec modelsince;
+unsigned int maxstale = 33;
+
+/* history size limit in MiB, and optional file for older history */
+unsigned int histsize = 4;
+char *histfile = NULL;
+
+/* command to run in the first terminal instead of the shell */
+char **cmdargv = NULL;
+
+/* -R records the pty output, -p replays such a record instead of a shell */
+struct record *recorder = NULL;
+char *replayfile = NULL;
+bool replayfast = false;
+
+/*
+ * With -T, hidden terminals are parsed by worker threads, terminal i by
+ * workers[i % nworkers]. A terminal is handed back and forth between batches
+ * of input, under its lock. Workers report a failed pty through notifyfd.
+ */
+struct worker {
+	pthread_t thread;
+	int wakefd[2];
+	char readbuf[READBUFSIZE];
+};
+struct worker workers[MAXTERMS];
+unsigned int nworkers = 0;
+atomic_bool workersquit = false;
+int notifyfd[2] = { -1, -1 };
+struct event *notifyev;
+
 /* Synchronize xkbcommon keyboard LED state to the hardware keyboard */
 static void
 update_kbd_leds(void)
@@ -214,222 +198,6 @@ update_kbd_leds(void)
 	kbdev_set_leds(kbdst, ledstate);
 }
 
-static void
-dirty_cell_slow(struct terminal *t, uint16_t col, uint16_t row)
-{
-	if (!dirtyflag && !t->buf[row * t->winsz.ws_col + col].dirty) {
-		t->buf[row * t->winsz.ws_col + col].dirty = 1;
-		dirtybuf[dirtycount] = row * t->winsz.ws_col + col;
-		dirtycount++;
-	}
-}
-
-static void
-dirty_cell_fast(struct terminal *t __unused, uint16_t col __unused,
-    uint16_t row __unused)
-{
-	dirtyflag = 1;
-}
-
-static void
-render_cell(struct terminal *t, uint16_t col, uint16_t row)
-{
-	struct bufent *cell;
-	teken_attr_t *attr;
-	teken_char_t ch;
-	uint16_t sx, sy;
-	uint32_t bg, fg, val;
-	int cursor, flags = 0;
-
-	cell = &t->buf[row * t->winsz.ws_col + col];
-	attr = &cell->attr;
-	cursor = cell->cursor;
-	ch = cell->ch;
-
-	sx = col * fnwidth;
-	sy = row * fnheight;
-	if (attr->ta_format & TF_REVERSE) {
-		fg = attr->ta_bgcolor;
-		bg = attr->ta_fgcolor;
-	} else {
-		fg = attr->ta_fgcolor;
-		bg = attr->ta_bgcolor;
-	}
-	if (fg < TC_NCOLORS) {
-		if (attr->ta_format & TF_BOLD)
-			fg = colormap[fg + TC_NCOLORS];
-		else
-			fg = colormap[fg];
-	} else {
-		fg = colormap[TC_WHITE];
-		err(1, "color out of range: %d\n", attr->ta_fgcolor);
-	}
-	if (bg < TC_NCOLORS) {
-		bg = colormap[bg];
-	} else {
-		bg = colormap[TC_BLACK];
-		err(1, "color out of range: %d\n", bg);
-	}
-	if (t->showcursor && cursor) {
-		val = fg;
-		fg = bg;
-		bg = val;
-	}
-	if (attr->ta_format & TF_UNDERLINE)
-		flags |= 1;
-	if (attr->ta_format & TF_BOLD)
-		flags |= 2;
-	rop32_rect(rop, (point){sx, sy},
-	    (dimension){fnwidth, fnheight}, bg);
-	if (ch != ' ')
-		rop32_char(rop, (point){sx, sy}, fg, bg, ch, flags);
-}
-
-static void
-set_cell_slow(struct terminal *t, uint16_t col, uint16_t row, teken_char_t ch,
-    const teken_attr_t *attr)
-{
-	teken_char_t oldch;
-	teken_attr_t oattr;
-
-	oldch = t->buf[row * t->winsz.ws_col + col].ch;
-	if (ch == oldch) {
-		oattr = t->buf[row * t->winsz.ws_col + col].attr;
-		if (oattr.ta_format == attr->ta_format &&
-		    oattr.ta_fgcolor == attr->ta_fgcolor &&
-		    oattr.ta_bgcolor == attr->ta_bgcolor)
-			return;
-	}
-	t->buf[row * t->winsz.ws_col + col].ch = ch;
-	t->buf[row * t->winsz.ws_col + col].attr = *attr;
-	dirty_cell_slow(t, col, row);
-}
-
-static void
-set_cell_medium(struct terminal *t, uint16_t col, uint16_t row, teken_char_t ch,
-    const teken_attr_t *attr)
-{
-	teken_char_t oldch;
-	teken_attr_t oattr;
-
-	oldch = t->buf[row * t->winsz.ws_col + col].ch;
-	if (ch == oldch) {
-		oattr = t->buf[row * t->winsz.ws_col + col].attr;
-		if (oattr.ta_format == attr->ta_format &&
-		    oattr.ta_fgcolor == attr->ta_fgcolor &&
-		    oattr.ta_bgcolor == attr->ta_bgcolor)
-			return;
-	}
-	t->buf[row * t->winsz.ws_col + col].ch = ch;
-	t->buf[row * t->winsz.ws_col + col].attr = *attr;
-	dirty_cell_fast(t, col, row);
-}
-
-void
-fbteken_bell(void *thunk __unused)
-{
-	/* XXX */
-}
-
-void
-fbteken_cursor(void *thunk, const teken_pos_t *pos)
-{
-	struct terminal *t = (struct terminal *)thunk;
-
-	if (t->cursorpos.tp_col == pos->tp_col &&
-	    t->cursorpos.tp_row == pos->tp_row)
-		return;
-	t->cursorpos = *pos;
-}
-
-void
-fbteken_putchar(void *thunk, const teken_pos_t *pos, teken_char_t ch,
-    const teken_attr_t *attr)
-{
-	struct terminal *t = (struct terminal *)thunk;
-
-	set_cell_slow(t, pos->tp_col, pos->tp_row, ch, attr);
-}
-
-void
-fbteken_fill(void *thunk, const teken_rect_t *rect, teken_char_t ch,
-    const teken_attr_t *attr)
-{
-	struct terminal *t = (struct terminal *)thunk;
-	teken_unit_t a, b;
-
-	for (a = rect->tr_begin.tp_row; a < rect->tr_end.tp_row; a++) {
-		for (b = rect->tr_begin.tp_col; b < rect->tr_end.tp_col; b++) {
-			set_cell_medium(t, b, a, ch, attr);
-		}
-	}
-}
-
-void
-fbteken_copy(void *thunk, const teken_rect_t *rect, const teken_pos_t *pos)
-{
-	struct terminal *t = (struct terminal *)thunk;
-	teken_unit_t w, h;
-	teken_unit_t scol, srow, tcol, trow;
-	int a;
-
-	scol = rect->tr_begin.tp_col;
-	srow = rect->tr_begin.tp_row;
-	tcol = pos->tp_col;
-	trow = pos->tp_row;
-	w = rect->tr_end.tp_col - rect->tr_begin.tp_col;
-	h = rect->tr_end.tp_row - rect->tr_begin.tp_row;
-
-	if (srow < trow) {
-		for (a = h - 1; a >= 0; a--) {
-			memmove(&t->buf[(trow + a) * t->winsz.ws_col + tcol],
-			    &t->buf[(srow + a) * t->winsz.ws_col + scol],
-			    w * sizeof(*t->buf));
-		}
-	} else {
-		for (a = 0; a < h; a++) {
-			memmove(&t->buf[(trow + a) * t->winsz.ws_col + tcol],
-			    &t->buf[(srow + a) * t->winsz.ws_col + scol],
-			    w * sizeof(*t->buf));
-		}
-	}
-	dirtyflag = 1;
-}
-
-void
-fbteken_param(void *thunk, int param, unsigned int val)
-{
-	struct terminal *t = (struct terminal *)thunk;
-
-//	fprintf(stderr, "fbteken_param param=%d val=%u\n", param, val);
-	switch (param) {
-	case 0:
-		if (val)
-			t->showcursor = 1;
-		else
-			t->showcursor = 0;
-		break;
-	case 1:
-		if (val)
-			t->keypad = 1;
-		else
-			t->keypad = 0;
-		break;
-	case 6:
-		/* XXX */
-		break;
-	default:
-		break;
-	}
-}
-
-void
-fbteken_respond(void *thunk __unused, const void *arg __unused,
-    size_t sz __unused)
-{
-	/* XXX */
-}
-
 static void
 set_nonblocking(int fd)
 {
@@ -589,14 +357,9 @@ vtdeconf(void)
 static void
 wait_vblank(void)
 {
-	if (active && (dirtyflag || dirtycount > 0)) {
-		drmVBlank req = {
-			.request.type = _DRM_VBLANK_RELATIVE |
-					_DRM_VBLANK_EVENT,
-			.request.sequence = 1,
-			.request.signal = 0
-		};
-		drmWaitVBlank(gfxstate.fd, &req);
+	if (active && !vblankpending && (damaged || readyfb != -1)) {
+		if (backend->wait_vblank() == 0)
+			vblankpending = true;
 	}
 }
 
@@ -604,44 +367,461 @@ static void
 handleidle(evutil_socket_t fd __unused, short events __unused,
     void *arg __unused)
 {
-	drm_set_dpms(&gfxstate, DRM_MODE_DPMS_SUSPEND);
+	backend->set_dpms(false);
 
 	if (active)
 		event_add(idleev, &idletv);
 }
 
+static void	rdmaster(evutil_socket_t fd, short events, void *arg);
+
+/* Set up the i-th terminal, and start a shell in it */
+static int
+term_start(unsigned int i)
+{
+	struct terminal *t = &terms[i];
+	char termenv[] = "TERM=xterm";
+	char defaultshell[] = "/bin/sh";
+	char *shell, *path;
+	teken_pos_t winsize;
+	unsigned int j;
+	char c;
+	int ret;
+
+	memset(t, 0, offsetof(struct terminal, lock));
+	winsize.tp_col = framebuffers[0].width / fnwidth;
+	winsize.tp_row = framebuffers[0].height / fnheight;
+	t->winsz.ws_col = winsize.tp_col;
+	t->winsz.ws_row = winsize.tp_row;
+	t->winsz.ws_xpixel = t->winsz.ws_col * fnwidth;
+	t->winsz.ws_ypixel = t->winsz.ws_row * fnheight;
+	if (cellbuf_init(&t->buf, winsize.tp_col, winsize.tp_row) != 0) {
+		warnx("Failed to allocate terminal buffer");
+		return 1;
+	}
+	for (j = 0; j < t->buf.cols * t->buf.nrows; j++)
+		t->buf.cells[j] = make_cell(' ', termattr);
+	if (histsize > 0) {
+		t->hist = history_init(winsize.tp_col,
+		    (size_t)histsize * 1024 * 1024);
+		if (t->hist == NULL ||
+		    cellbuf_init(&t->view, winsize.tp_col,
+		    winsize.tp_row) != 0) {
+			warnx("Failed to allocate history buffer");
+			goto fail;
+		}
+		if (histfile != NULL) {
+			if (i == 0)
+				path = strdup(histfile);
+			else if (asprintf(&path, "%s.%u", histfile, i) == -1)
+				path = NULL;
+			if (path == NULL ||
+			    history_setfile(t->hist, path) != 0) {
+				warn("%s", path != NULL ? path : histfile);
+				free(path);
+				goto fail;
+			}
+			free(path);
+		}
+	}
+
+	teken_init(&t->tek, &tek_funcs, t);
+	teken_set_defattr(&t->tek, termattr);
+	teken_set_winsize(&t->tek, &winsize);
+	t->keypad = 0;
+	t->showcursor = 1;
+
+	t->child = forkpty(&t->amaster, NULL, NULL, &t->winsz);
+	if (t->child == -1) {
+		warn("forkpty");
+		goto fail;
+	} else if (t->child == 0) {
+		/* Don't leak the drm and tty file descriptors */
+		closefrom(STDERR_FILENO + 1);
+		signal(SIGINT, SIG_DFL);
+		if (replayfile != NULL) {
+			ret = record_replay(replayfile, i, replayfast);
+			/* Keep showing the final screen until a key press */
+			if (!headless)
+				read(STDIN_FILENO, &c, 1);
+			exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		shell = getenv("SHELL");
+		if (shell == NULL)
+			shell = defaultshell;
+		putenv(termenv);
+		if (i == 0 && cmdargv != NULL) {
+			execvp(cmdargv[0], cmdargv);
+			err(EXIT_FAILURE, "%s", cmdargv[0]);
+		}
+		if (execlp(shell, basename(shell), NULL) == -1)
+			err(EXIT_FAILURE, "execlp");
+	}
+	set_nonblocking(t->amaster);
+
+	t->masterev = event_new(evbase, t->amaster,
+	    EV_READ | EV_PERSIST, rdmaster, t);
+	event_priority_set(t->masterev, 4);
+	event_add(t->masterev, NULL);
+	t->started = true;
+
+	return 0;
+
+fail:
+	cellbuf_free(&t->buf);
+	if (t->hist != NULL) {
+		history_free(t->hist);
+		cellbuf_free(&t->view);
+	}
+	return 1;
+}
+
+static void
+term_stop(struct terminal *t)
+{
+	atomic_store(&t->inworker, false);
+	event_free(t->masterev);
+	close(t->amaster);
+	waitpid(t->child, NULL, WNOHANG);
+	cellbuf_free(&t->buf);
+	if (t->hist != NULL) {
+		history_free(t->hist);
+		cellbuf_free(&t->view);
+	}
+	t->started = false;
+}
+
+/* Let a worker parse the output of a hidden terminal */
+static void
+term_toworker(struct terminal *t)
+{
+	struct worker *w;
+	char c = 0;
+
+	if (nworkers == 0 || t->dead)
+		return;
+	event_del(t->masterev);
+	atomic_store(&t->inworker, true);
+	w = &workers[(t - terms) % nworkers];
+	if (write(w->wakefd[1], &c, 1) == -1 && errno != EAGAIN)
+		warn("write");
+}
+
+/* Show the i-th terminal, starting it if necessary */
+static int
+switch_term(unsigned int i)
+{
+	struct terminal *t = &terms[i], *old = curterm;
+	unsigned int j;
+	bool dead;
+
+	if (t == curterm)
+		return 0;
+	if (!t->started && term_start(i) != 0)
+		return 1;
+
+	/* Take it back from its worker, which finishes the current batch */
+	atomic_store(&t->inworker, false);
+	pthread_mutex_lock(&t->lock);
+	dead = t->dead;
+	pthread_mutex_unlock(&t->lock);
+	if (dead)
+		return 1;
+	event_add(t->masterev, NULL);
+
+	old->histoff = 0;
+	old->shown = false;
+	modelonly = false;
+	t->shown = true;
+	curterm = t;
+	term_toworker(old);
+
+	/* Everything which differs from the previous terminal gets redrawn */
+	for (j = 0; j < t->winsz.ws_row; j++)
+		mark_damage(j, 0, t->winsz.ws_col);
+	wait_vblank();
+	return 0;
+}
+
+/* The shell in a terminal exited, or its pty failed */
+static void
+term_exit(struct terminal *t)
+{
+	unsigned int i;
+
+	t->dead = true;
+	for (i = 0; i < nterms; i++) {
+		if (&terms[i] != t && terms[i].started &&
+		    (t != curterm || switch_term(i) == 0))
+			break;
+	}
+	if (i == nterms) {
+		/* This was the last one */
+		event_base_loopbreak(evbase);
+		return;
+	}
+	term_stop(t);
+}
+
+/* Scroll the shown part of the history back by n rows, or forward if n < 0 */
+static void
+scroll_history(struct terminal *t, int n)
+{
+	unsigned int off, i;
+	int line;
+
+	if (t->hist == NULL)
+		return;
+	if (n < 0)
+		off = t->histoff - MIN(t->histoff, (unsigned int)-n);
+	else
+		off = MIN(t->histoff + n, history_rows(t->hist));
+	if (off == t->histoff)
+		return;
+	t->histoff = off;
+
+	for (i = 0; i < t->winsz.ws_row; i++) {
+		line = (int)i - (int)off;
+		if (off > 0 && line < 0) {
+			history_get(t->hist, -line - 1,
+			    cellbuf_row(&t->view, i));
+		} else if (off > 0) {
+			memcpy(cellbuf_row(&t->view, i),
+			    cellbuf_row(&t->buf, line),
+			    t->buf.cols * sizeof(cell_t));
+		}
+		mark_damage(i, 0, t->winsz.ws_col);
+	}
+	wait_vblank();
+}
+
+/*
+ * Drain the pty until it would block, or the budget is used up, and return
+ * the result of the last read(). Used by the main thread and the workers.
+ */
+static ssize_t
+term_parse(struct terminal *t, char *buf, size_t size, struct timespec *start,
+    size_t *total)
+{
+	struct timespec now;
+	ssize_t val;
+
+	*total = 0;
+	clock_gettime(CLOCK_MONOTONIC, start);
+	for (;;) {
+		val = read(t->amaster, buf, size);
+		if (val <= 0)
+			break;
+		/* Output jumps back to the bottom of the history */
+		if (t->histoff > 0)
+			scroll_history(t, -(int)t->histoff);
+		if (recorder != NULL)
+			record_write(recorder, t - terms, buf, val);
+		teken_input(&t->tek, buf, val);
+		*total += val;
+		if (*total >= readlimit)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start->tv_sec) * 1000000000L +
+		    (now.tv_nsec - start->tv_nsec) >= READTIME)
+			break;
+	}
+	return val;
+}
+
+/*
+ * Free the grapheme clusters which are no longer used by any cells. All
+ * the terminals are locked, so that workers don't change their cells.
+ */
+static void
+collect_graphemes(void)
+{
+	struct terminal *t;
+	unsigned int i;
+
+	for (i = 0; i < nterms; i++)
+		pthread_mutex_lock(&terms[i].lock);
+	for (i = 0; i < nterms; i++) {
+		t = &terms[i];
+		if (!t->started)
+			continue;
+		grapheme_mark(t->buf.cells, (size_t)t->buf.cols * t->buf.nrows);
+		if (t->hist != NULL) {
+			grapheme_mark(t->view.cells,
+			    (size_t)t->view.cols * t->view.nrows);
+			history_scan(t->hist, grapheme_mark);
+		}
+	}
+	grapheme_mark(oldbuf.cells, (size_t)oldbuf.cols * oldbuf.nrows);
+	grapheme_sweep();
+	for (i = 0; i < nterms; i++)
+		pthread_mutex_unlock(&terms[i].lock);
+}
+
 static void
 rdmaster(evutil_socket_t fd __unused, short events __unused, void *arg)
 {
 	struct terminal *t = (struct terminal *)arg;
-	char s[0x1000];
-	teken_pos_t oc;
-	uint32_t prevdirty, prevdirtyflag;
-	int val;
+	struct timespec start, now;
+	size_t total;
+	ssize_t val;
+	unsigned int i;
+
+	/* Rendering happens on the next vblank, no matter how much we read */
+	val = term_parse(t, readbuf, sizeof(readbuf), &start, &total);
+	if (val == 0 || (val < 0 && errno != EAGAIN)) {
+		term_exit(t);
+		return;
+	}
+	if (grapheme_gcwanted())
+		collect_graphemes();
+	if (t != curterm)
+		return;
+	if (val > 0 && maxstale > 0 && !modelonly) {
+		/* More output is pending, skip the intermediate frames */
+		modelonly = true;
+		modelsince = start;
+		return;
+	}
+	if (modelonly) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (val > 0 && (now.tv_sec - modelsince.tv_sec) * 1000L +
+		    (now.tv_nsec - modelsince.tv_nsec) / 1000000 < maxstale)
+			return;
+		modelonly = false;
+		for (i = 0; i < t->winsz.ws_row; i++)
+			mark_damage(i, 0, t->winsz.ws_col);
+	}
+	if (total > 0) {
+		/* Schedule a redraw when only the cursor changed */
+		if (!damaged && cursor_moved(t))
+			damaged = true;
+		wait_vblank();
+	}
+}
 
-	val = read(t->amaster, s, 0x1000);
-	if (val > 0) {
-		prevdirty = dirtycount;
-		prevdirtyflag = dirtyflag;
-		oc = t->cursorpos;
-		t->buf[oc.tp_row * t->winsz.ws_col + oc.tp_col].cursor = 0;
-		teken_input(&t->tek, s, val);
-		if (oc.tp_col != t->cursorpos.tp_col ||
-		    oc.tp_row != t->cursorpos.tp_row) {
-			t->buf[oc.tp_row * t->winsz.ws_col + oc.tp_col].cursor = 0;
-			t->buf[t->cursorpos.tp_row * t->winsz.ws_col + t->cursorpos.tp_col].cursor = 1;
-			dirty_cell_slow(t, oc.tp_col, oc.tp_row);
-			dirty_cell_slow(t, t->cursorpos.tp_col, t->cursorpos.tp_row);
-		} else {
-			t->buf[oc.tp_row * t->winsz.ws_col + oc.tp_col].cursor = 1;
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct pollfd fds[MAXTERMS + 1];
+	struct terminal *polled[MAXTERMS], *t;
+	struct timespec start;
+	size_t total;
+	ssize_t val;
+	unsigned int i, n, idx;
+	char c;
+
+	for (;;) {
+		fds[0].fd = w->wakefd[0];
+		fds[0].events = POLLIN;
+		n = 0;
+		for (i = w - workers; i < nterms; i += nworkers) {
+			if (!atomic_load(&terms[i].inworker))
+				continue;
+			polled[n] = &terms[i];
+			fds[n + 1].fd = terms[i].amaster;
+			fds[n + 1].events = POLLIN;
+			n++;
 		}
-		if (prevdirty == 0 || prevdirtyflag == 0)
-			wait_vblank();
-	} else if (val == 0 || errno != EAGAIN) {
-		event_base_loopbreak(evbase);
+		if (poll(fds, n + 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			break;
+		}
+		if (atomic_load(&workersquit))
+			break;
+		/* Terminals were handed over, rebuild the poll set */
+		while (read(w->wakefd[0], &c, 1) > 0)
+			;
+
+		for (i = 0; i < n; i++) {
+			t = polled[i];
+			if (fds[i + 1].revents == 0)
+				continue;
+			pthread_mutex_lock(&t->lock);
+			if (atomic_load(&t->inworker)) {
+				val = term_parse(t, w->readbuf,
+				    sizeof(w->readbuf), &start, &total);
+				if (val == 0 || (val < 0 && errno != EAGAIN)) {
+					t->dead = true;
+					atomic_store(&t->inworker, false);
+					idx = t - terms;
+					if (write(notifyfd[1], &idx,
+					    sizeof(idx)) == -1)
+						warn("write");
+				}
+			}
+			pthread_mutex_unlock(&t->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* A worker gave up on the pty of a hidden terminal */
+static void
+workerexit(evutil_socket_t fd, short events __unused, void *arg __unused)
+{
+	unsigned int idx;
+
+	while (read(fd, &idx, sizeof(idx)) == sizeof(idx)) {
+		if (idx < nterms && terms[idx].started)
+			term_exit(&terms[idx]);
 	}
 }
 
+static void
+workers_start(void)
+{
+	sigset_t set, oset;
+	unsigned int i;
+
+	if (pipe(notifyfd) == -1)
+		err(1, "pipe");
+	set_nonblocking(notifyfd[0]);
+	notifyev = event_new(evbase, notifyfd[0],
+	    EV_READ | EV_PERSIST, workerexit, NULL);
+	event_priority_set(notifyev, 4);
+	event_add(notifyev, NULL);
+
+	/* Signals are handled by the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (i = 0; i < nworkers; i++) {
+		if (pipe(workers[i].wakefd) == -1)
+			err(1, "pipe");
+		set_nonblocking(workers[i].wakefd[0]);
+		set_nonblocking(workers[i].wakefd[1]);
+		errno = pthread_create(&workers[i].thread, NULL, worker_main,
+		    &workers[i]);
+		if (errno != 0)
+			err(1, "pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+static void
+workers_stop(void)
+{
+	unsigned int i;
+	char c = 0;
+
+	atomic_store(&workersquit, true);
+	for (i = 0; i < nworkers; i++) {
+		if (write(workers[i].wakefd[1], &c, 1) == -1 &&
+		    errno != EAGAIN)
+			warn("write");
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].wakefd[0]);
+		close(workers[i].wakefd[1]);
+	}
+	event_free(notifyev);
+	close(notifyfd[0]);
+	close(notifyfd[1]);
+}
+
 static int
 fbteken_key_get_utf8(xkb_keycode_t code, uint8_t *buf, int len)
 {
@@ -823,57 +1003,43 @@ handle_term_special_keysym(xkb_keysym_t sym, uint8_t *buf, size_t len)
 	return 0;
 }
 
-static void
-drm_set_dpms(struct drm_state *dst, int level)
-{
-	int i;
-	drmModePropertyPtr prop = NULL, props;
-
-	if (level == dst->dpms_mode)
-		return;
-
-	for (i = 0; i < dst->conn->count_props; i++) {
-		props = drmModeGetProperty(dst->fd, dst->conn->props[i]);
-		if (props == NULL)
-			continue;
-
-		if (strcmp(props->name, "DPMS") == 0) {
-			prop = props;
-			break;
-		}
-		drmModeFreeProperty(props);
-	}
-
-	if (prop == NULL)
-		return;
-
-	drmModeConnectorSetProperty(dst->fd, dst->conn->connector_id,
-	    prop->prop_id, level);
-	drmModeFreeProperty(prop);
-	dst->dpms_mode = level;
-}
-
 static int
 handle_keypress(xkb_keycode_t code, xkb_keysym_t sym, uint8_t *buf, int len)
 {
-	int switchvt;
+	int switchvt, n;
 
 	/* Reset idle timeout */
 	if (idleev != NULL && active)
 		event_add(idleev, &idletv);
 
 	if (sym == XKB_KEY_Print) {
-		drm_set_dpms(&gfxstate, DRM_MODE_DPMS_SUSPEND);
+		backend->set_dpms(false);
 		return 0;
 	} else {
-		drm_set_dpms(&gfxstate, DRM_MODE_DPMS_ON);
+		backend->set_dpms(true);
 	}
 
 	if ((switchvt = handle_vtswitch(sym)) > 0) {
 		ioctl(ttyfd, VT_ACTIVATE, switchvt);
 		return 0;
 	}
-	return do_handle_keysym(sym, code, buf, len);
+	if (nterms > 1 && sym >= XKB_KEY_F1 && sym < XKB_KEY_F1 + nterms &&
+	    xkb_state_mod_name_is_active(state, "Mod1",
+	    XKB_STATE_MODS_EFFECTIVE)) {
+		switch_term(sym - XKB_KEY_F1);
+		return 0;
+	}
+	if ((sym == XKB_KEY_Page_Up || sym == XKB_KEY_Page_Down) &&
+	    curterm->hist != NULL && xkb_state_mod_name_is_active(state,
+	    "Shift", XKB_STATE_MODS_EFFECTIVE)) {
+		n = curterm->winsz.ws_row / 2;
+		scroll_history(curterm, sym == XKB_KEY_Page_Up ? n : -n);
+		return 0;
+	}
+	n = do_handle_keysym(sym, code, buf, len);
+	if (n > 0 && curterm->histoff > 0)
+		scroll_history(curterm, -(int)curterm->histoff);
+	return n;
 }
 
 /* Reading keyboard input from the tty which was set into raw mode */
@@ -943,79 +1109,142 @@ ttyread(evutil_socket_t fd __unused, short events __unused, void *arg __unused)
 	}
 }
 
-static int
-cmp_cells(struct terminal *t, int i)
+/*
+ * Bring framebuffer fb up to date, by copying the cells which changed since
+ * it was last drawn into from src (the latest framebuffer, or the shadow
+ * buffer).
+ */
+static void
+copy_damage(struct terminal *t, int fb, const void *src, uint32_t srcpitch)
 {
-	teken_attr_t a, b;
+	struct framebuffer *dst = &framebuffers[fb];
+	struct rowdamage *d = fbdamage[fb];
+	unsigned int i, y, off, len;
 
-	a = t->buf[i].attr;
-	b = oldbuf[i].attr;
-
-	if (t->buf[i].ch != oldbuf[i].ch ||
-	    t->buf[i].cursor != oldbuf[i].cursor ||
-	    a.ta_format != b.ta_format ||
-	    a.ta_fgcolor != b.ta_fgcolor ||
-	    a.ta_bgcolor != b.ta_bgcolor) {
-		return 1;
+	for (i = 0; i < t->winsz.ws_row; i++) {
+		if (d[i].x0 >= d[i].x1)
+			continue;
+		off = d[i].x0 * fnwidth * sizeof(uint32_t);
+		len = (d[i].x1 - d[i].x0) * fnwidth * sizeof(uint32_t);
+		for (y = i * fnheight; y < (i + 1) * fnheight; y++) {
+			memcpy((uint8_t *)dst->plane + y * dst->pitch + off,
+			    (const uint8_t *)src + y * srcpitch + off, len);
+		}
+		d[i].x0 = d[i].x1 = 0;
 	}
+}
 
-	return 0;
+static void
+flip_ready(void)
+{
+	if (backend->flip(&framebuffers[readyfb]) != 0) {
+		/* Try again on the next vblank */
+		wait_vblank();
+		return;
+	}
+	flipfb = readyfb;
+	readyfb = -1;
 }
 
+/*
+ * Draw the screen updates into a framebuffer which isn't scanned out, and
+ * flip to it.
+ */
 static void
-redraw_term(struct terminal *t)
+present_term(struct terminal *t)
 {
-	int idx;
-	unsigned int i, cols, rows;
-
-	cols = t->winsz.ws_col;
-	rows = t->winsz.ws_row;
-	if (dirtyflag) {
-		for (i = 0; i < cols * rows; i++) {
-			t->buf[i].dirty = 0;
-			if (cmp_cells(t, i)) {
-				render_cell(t, i % cols, i / cols);
-			}
-		}
+	struct framebuffer *fbp;
+	unsigned int i;
+	int fb, j;
+
+	if (nfbs == 1 && shadowbuf == NULL) {
+		redraw_term(t);
+		return;
+	}
+
+	if (nfbs == 1) {
+		fb = 0;
+	} else if (readyfb != -1) {
+		fb = readyfb;
 	} else {
-		for (i = 0; i < dirtycount; i++) {
-			idx = dirtybuf[i];
-//			if (t->buf[idx].dirty) {
-				t->buf[idx].dirty = 0;
-				render_cell(t, idx % cols, idx / cols);
-//			}
+		for (fb = 0; fb < nfbs; fb++) {
+			if (fb != frontfb && fb != flipfb)
+				break;
 		}
-		for (i = 0; i < cols * rows; i++) {
-			t->buf[i].dirty = 0;
+		/* The page flip handler will call us again */
+		if (fb == nfbs)
+			return;
+	}
+
+	if (shadowbuf == NULL) {
+		fbp = &framebuffers[latestfb];
+		copy_damage(t, fb, fbp->plane, fbp->pitch);
+		fbp = &framebuffers[fb];
+		set_drawcontext(fbp->plane, fbp->pitch / sizeof(uint32_t));
+	}
+	redraw_term(t);
+	for (i = 0; i < t->winsz.ws_row; i++) {
+		if (framedamage[i].x0 >= framedamage[i].x1)
+			continue;
+		for (j = 0; j < nfbs; j++) {
+			if (j != fb || shadowbuf != NULL) {
+				add_damage(&fbdamage[j][i], framedamage[i].x0,
+				    framedamage[i].x1);
+			}
 		}
+		framedamage[i].x0 = framedamage[i].x1 = 0;
 	}
+	if (shadowbuf != NULL) {
+		copy_damage(t, fb, shadowbuf,
+		    framebuffers[fb].width * sizeof(uint32_t));
+	}
+	latestfb = fb;
+	if (nfbs == 1)
+		return;
+	readyfb = fb;
 
-	memcpy(oldbuf, t->buf, cols * rows * sizeof(*t->buf));
+	if (flipfb == -1)
+		flip_ready();
+}
 
-	dirtycount = 0;
-	dirtyflag = 0;
+void
+handle_vblank(void)
+{
+	vblankpending = false;
+	if (grapheme_gcwanted())
+		collect_graphemes();
+	present_term(curterm);
 }
 
-static void
-handle_vblank(int fd __unused, unsigned int sequence __unused,
-    unsigned int tv_sec __unused, unsigned int tv_usec __unused,
-    void *user_data __unused)
+void
+handle_page_flip(void)
 {
-	redraw_term(curterm);
+	/* Stale event from before a VT switch */
+	if (flipfb == -1)
+		return;
+
+	frontfb = flipfb;
+	flipfb = -1;
+	if (active && (readyfb != -1 || damaged))
+		present_term(curterm);
 }
 
+/* Draw the last screen contents before exiting, for the headless dumps */
 static void
-drmread(evutil_socket_t fd __unused, short events __unused, void *arg __unused)
+flush_frames(void)
 {
-	drmEventContext evctx = {
-		.version = DRM_EVENT_CONTEXT_VERSION,
-		.vblank_handler = handle_vblank,
-		.page_flip_handler = NULL
-	};
+	unsigned int i;
 
-	if (drmHandleEvent(gfxstate.fd, &evctx) != 0) {
-		warnx("drmHandleEvent failed");
-		event_base_loopbreak(evbase);
+	if (modelonly) {
+		modelonly = false;
+		for (i = 0; i < curterm->winsz.ws_row; i++)
+			mark_damage(i, 0, curterm->winsz.ws_col);
+	}
+	while (flipfb != -1 || readyfb != -1 || damaged) {
+		if (flipfb != -1)
+			handle_page_flip();
+		else
+			present_term(curterm);
 	}
 }
 
@@ -1025,7 +1254,7 @@ vtrelease(evutil_socket_t fd __unused, short events __unused,
 {
 	printf("vtleave\n");
 
-	drm_set_dpms(&gfxstate, DRM_MODE_DPMS_ON);
+	backend->set_dpms(true);
 	repkeycode = 0;
 	repkeysym = 0;
 	evtimer_del(repeatev);
@@ -1035,7 +1264,7 @@ vtrelease(evutil_socket_t fd __unused, short events __unused,
 	xkb_reset();
 	update_kbd_leds();
 
-	drm_backend_hide(&gfxstate);
+	backend->hide();
 	ioctl(ttyfd, VT_RELDISP, VT_TRUE);
 	active = false;
 }
@@ -1048,7 +1277,10 @@ vtacquire(evutil_socket_t fd __unused, short events __unused,
 	ioctl(ttyfd, VT_RELDISP, VT_ACKACQ);
 	ioctl(ttyfd, VT_ACTIVATE, vtnum);
 	ioctl(ttyfd, VT_WAITACTIVE, vtnum);
-	drm_backend_show(&gfxstate, &framebuffer);
+	backend->show(&framebuffers[latestfb]);
+	frontfb = latestfb;
+	flipfb = readyfb = -1;
+	vblankpending = false;
 	active = true;
 	if (idleev != NULL)
 		event_add(idleev, &idletv);
@@ -1144,241 +1376,40 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: %s [-a | -A] [-hw] [-d delay] [-r rate] [-f fontfile "
-	    "[-F bold_fontfile]] [-i idle_timeout] [-s fontsize] "
-	    "[-k kbd_layout] [-o kbd_options] [-v kbd_variant]\n",
+	    "usage: %s [-a | -A] [-hSwx] [-b buffers] [-B backend] "
+	    "[-c cachesize] [-d delay] [-D prefix] [-r rate] "
+	    "[-f fontfile [-F bold_fontfile]] [-g widthxheight] [-H histsize] "
+	    "[-P histfile] [-i idle_timeout] "
+	    "[-l readlimit] [-m maxstale] [-N terminals] [-p replayfile] "
+	    "[-R recordfile] [-t threads] "
+	    "[-T threads] [-s fontsize] [-k kbd_layout] [-o kbd_options] "
+	    "[-v kbd_variant] [command [arg ...]]\n",
 	    getprogname());
 	exit(1);
 }
 
-static int
-drm_backend_init(struct drm_state *dst)
-{
-	drmModeResPtr res;
-	drmModeEncoderPtr enc;
-	int fd, i;
-
-	fd = drmOpen("i915", NULL);
-	if (fd < 0) {
-		perror("drmOpen(\"i915\", NULL)");
-		fd = drmOpen("radeon", NULL);
-		if (fd < 0) {
-			perror("drmOpen(\"radeon\", NULL)");
-			return 1;
-		}
-	}
-
-	dst->fd = fd;
-	dst->dpms_mode = DRM_MODE_DPMS_ON;
-
-	res = drmModeGetResources(fd);
-	if (res == NULL) {
-		warn("drmModeGetResources");
-		return 1;
-	}
-#if 0
-	printf("count_fbs: %d, count_crtcs: %d, count_connectors: %d, "
-	    "min_width: %u, max_width: %u, min_height: %u, max_height: %u\n",
-	    res->count_fbs, res->count_crtcs, res->count_connectors,
-	    res->min_width, res->max_width, res->min_height, res->max_height);
-#endif
-
-	/* First take the first display output which is connected */
-	for (i = 0; i < res->count_connectors; ++i) {
-		dst->conn = drmModeGetConnector(fd, res->connectors[i]);
-		if(dst->conn->connection == DRM_MODE_CONNECTED)
-			break;
-	}
-	if (res->count_connectors <= 0) {
-		warnx("No Monitor connected");
-		return 1;
-	}
-#if 0
-	printf("dst->conn->mmWidth: %u\n", dst->conn->mmWidth);
-	printf("dst->conn->mmHeight: %u\n", dst->conn->mmHeight);
-	printf("dst->conn->connector_id = %u\n", dst->conn->connector_id);
-	printf("dst->conn->encoder_id = %u\n", dst->conn->encoder_id);
-	printf("dst->conn->connector_type = %u\n", dst->conn->connector_type);
-	printf("dst->conn->connector_type_id = %u\n", dst->conn->connector_type_id);
-	printf("dst->conn->count_modes = %u\n", dst->conn->count_modes);
-	printf("dst->conn->count_props = %u\n", dst->conn->count_props);
-	printf("dst->conn->count_encoders = %u\n", dst->conn->count_encoders);
-	for (i = 0; i < dst->conn->count_encoders; i++)
-		printf("gfxstate.conn->encoders[%d] = %u\n", i, gfxstate.conn->encoders[i]);
-#endif
-
-	/* Using only the first encoder in gfxstate.conn->encoders for now */
-	if (gfxstate.conn->count_encoders == 0) {
-		warnx("No encoders on this conection\n");
-		return 1;
-	} else if (gfxstate.conn->count_encoders > 1) {
-		printf("Using the first encoder in gfxstate.conn->encoders\n");
-	}
-	enc = drmModeGetEncoder(fd, gfxstate.conn->encoders[0]);
-#if 0
-	printf("enc->encoder_id = %u\n", enc->encoder_id);
-	printf("enc->encoder_type = %u\n", enc->encoder_type);
-	printf("enc->crtc_id = %u\n", enc->crtc_id);
-	printf("enc->possible_crtcs = %u\n", enc->possible_crtcs);
-	printf("enc->possible_clones = %u\n", enc->possible_clones);
-#endif
-
-	/*
-	 * Just use the index of the lowest bit set in enc->possible_crtcs
-	 * to select our crtc from res->crtcs.
-	 */
-	for (i = 0; i < MAX(32, res->count_crtcs); i++) {
-		if (enc->possible_crtcs & (1U << i)) {
-			gfxstate.crtc = drmModeGetCrtc(fd, res->crtcs[i]);
-			if (gfxstate.crtc != NULL)
-				break;
-		}
-	}
-	if (i == res->count_crtcs) {
-		warnx("No usable crtc found in enc->possible_crtcs\n");
-		return 1;
-	}
-
-	drmModeFreeResources(res);
-	drmModeFreeEncoder(enc);
-
-#if 0
-	printf("gfxstate.crtc->crtc_id = %u\n", gfxstate.crtc->crtc_id);
-	printf("gfxstate.crtc->buffer_id = %u\n", gfxstate.crtc->buffer_id);
-	printf("gfxstate.crtc->width/height = %ux%u\n", gfxstate.crtc->width, gfxstate.crtc->height);
-	printf("gfxstate.crtc->mode_valid = %u\n", gfxstate.crtc->mode_valid);
-	printf("x: %u, y: %u\n", crtc->x, gfxstate.crtc->y);
-#endif
-	gfxstate.oldbuffer_id = gfxstate.crtc->buffer_id;
-
-	/* Just use the first display mode given in gfxstate.conn->modes */
-	/* XXX Allow the user to override the mode via a commandline argument */
-	if (gfxstate.conn->count_modes == 0) {
-		warnx("No display mode specified in gfxstate.conn->modes\n");
-		return 1;
-	}
-	gfxstate.crtc->mode = gfxstate.conn->modes[0];
-#if 0
-	printf("Display mode:\n");
-	printf("clock: %u\n", gfxstate.crtc->mode.clock);
-	printf("vrefresh: %u\n", gfxstate.crtc->mode.vrefresh);
-	printf("hdisplay: %u\n", gfxstate.crtc->mode.hdisplay);
-	printf("hsync_start: %u hsync_end: %u\n",
-	    gfxstate.crtc->mode.hsync_start, gfxstate.crtc->mode.hsync_end);
-	printf("htotal: %u\n", gfxstate.crtc->mode.htotal);
-	printf("hskew: %u\n", gfxstate.crtc->mode.hskew);
-	printf("vdisplay: %u\n", gfxstate.crtc->mode.vdisplay);
-	printf("vsync_start: %u vsync_end: %u\n",
-	    gfxstate.crtc->mode.vsync_start, gfxstate.crtc->mode.vsync_end);
-	printf("vtotal: %u\n", gfxstate.crtc->mode.vtotal);
-	printf("vscan: %u\n", gfxstate.crtc->mode.vscan);
-	printf("flags: %u\n", gfxstate.crtc->mode.flags);
-	printf("type: %u\n", gfxstate.crtc->mode.type);
-#endif
-
-	kms_create(dst->fd, &dst->kms);
-
-	return 0;
-}
-
-static void
-drm_backend_finish(struct drm_state *dst)
-{
-	kms_destroy(&dst->kms);
-	drmModeFreeConnector(dst->conn);
-	drmModeFreeCrtc(dst->crtc);
-	drmClose(dst->fd);
-}
-static void
-drm_backend_allocfb(struct drm_state *dst, struct drm_framebuffer *fb)
-{
-	fb->width = dst->crtc->mode.hdisplay;
-	fb->height = dst->crtc->mode.vdisplay;
-
-	unsigned bo_attribs[] = {
-		KMS_WIDTH,	fb->width,
-		KMS_HEIGHT,	fb->height,
-		KMS_BO_TYPE,	KMS_BO_TYPE_SCANOUT_X8R8G8B8,
-		KMS_TERMINATE_PROP_LIST
-	};
-	kms_bo_create(dst->kms, bo_attribs, &fb->bo);
-	kms_bo_get_prop(fb->bo, KMS_HANDLE, &fb->handles[0]);
-	kms_bo_get_prop(fb->bo, KMS_PITCH, &fb->pitches[0]);
-#if 0
-	printf("fb->pitches[0] = %u\n", fb->pitches[0]);
-	printf("fb->handles[0] = %u\n", fb->handles[0]);
-#endif
-	fb->offsets[0] = 0;
-	kms_bo_map(fb->bo, &fb->plane);
-	drmModeAddFB2(dst->fd, fb->width, fb->height, DRM_FORMAT_XRGB8888,
-	    fb->handles, fb->pitches, fb->offsets,
-	    &fb->fbid, 0);
-}
-
-static void
-drm_backend_destroyfb(struct drm_state *dst, struct drm_framebuffer *fb)
-{
-	drmModeRmFB(dst->fd, fb->fbid);
-	kms_bo_unmap(fb->bo);
-	kms_bo_destroy(&fb->bo);
-}
-
-static int
-drm_backend_show(struct drm_state *dst, struct drm_framebuffer *fb)
-{
-	int ret = 0;
-
-	if (drmSetMaster(gfxstate.fd) != 0) {
-		perror("drmSetMaster");
-		ret = 1;
-	}
-	if (drmModeSetCrtc(dst->fd, dst->crtc->crtc_id, fb->fbid, 0, 0,
-	    &dst->conn->connector_id, 1, &dst->crtc->mode) != 0) {
-		perror("drmModeSetCrtc");
-		ret = 1;
-	}
-	return ret;
-}
-
-static int
-drm_backend_hide(struct drm_state *dst)
-{
-	int ret = 0;
-
-	if (drmModeSetCrtc(dst->fd, dst->crtc->crtc_id, dst->oldbuffer_id,
-	    0, 0, &dst->conn->connector_id, 1, &dst->crtc->mode) != 0) {
-		perror("drmModeSetCrtc");
-		ret = 1;
-	}
-	if (drmDropMaster(dst->fd) != 0) {
-		perror("drmDropMaster");
-		ret = 1;
-	}
-	return ret;
-}
-
 int
 main(int argc, char *argv[])
 {
-	char *shell;
-	teken_pos_t winsize;
-	struct terminal term;
 	char *normalfont = NULL, *boldfont = NULL;
+	unsigned int cols, rows;
 	int i, ch;
-	bool whitebg = false;
+	bool whitebg = false, shadow = false;
 
 	unsigned int fontheight = 16;
+	int cachesize = -1;
 	bool alpha = true;
 	char *kbd_layout = NULL, *kbd_options = NULL, *kbd_variant = NULL;
 
 	const char *errstr;
 	struct stat fontstat;
+	char c, *recfile = NULL;
 
 	unsigned int repeat_delay = 200;
 	unsigned int repeat_rate = 30;
 
 	/* XXX handle bitmap fonts better */
-	while ((ch = getopt(argc, argv, "aAhwd:r:f:F:i:k:o:v:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "aAhSwxb:B:c:d:D:r:f:F:g:H:i:k:l:m:N:o:p:P:R:t:T:v:s:")) != -1) {
 		switch (ch) {
 		case 'a':
 			alpha = true;
@@ -1386,6 +1417,28 @@ main(int argc, char *argv[])
 		case 'A':
 			alpha = false;
 			break;
+		case 'b':
+			nfbs = strtonum(optarg, 1, MAXFBS, &errstr);
+			if (errstr) {
+				errx(1, "number of framebuffers is %s: %s",
+				    errstr, optarg);
+			}
+			break;
+		case 'B':
+			if (strcmp(optarg, drm_backend.name) == 0)
+				backend = &drm_backend;
+			else if (strcmp(optarg, headless_backend.name) == 0)
+				backend = &headless_backend;
+			else
+				errx(1, "unknown backend: %s", optarg);
+			break;
+		case 'c':
+			cachesize = strtonum(optarg, 0, 1024*1024, &errstr);
+			if (errstr) {
+				errx(1, "glyph cache size is %s: %s", errstr,
+				    optarg);
+			}
+			break;
 		case 'd':
 			repeat_delay = strtonum(optarg, 100, 2000, &errstr);
 			if (errstr) {
@@ -1393,12 +1446,29 @@ main(int argc, char *argv[])
 				    optarg);
 			}
 			break;
+		case 'D':
+			headless_dump = optarg;
+			break;
 		case 'f':
 			normalfont = optarg;
 			break;
 		case 'F':
 			boldfont = optarg;
 			break;
+		case 'g':
+			if (sscanf(optarg, "%ux%u%c", &headless_width,
+			    &headless_height, &c) != 2 ||
+			    headless_width < 64 || headless_width > 16384 ||
+			    headless_height < 64 || headless_height > 16384)
+				errx(1, "invalid geometry: %s", optarg);
+			break;
+		case 'H':
+			histsize = strtonum(optarg, 0, 1024, &errstr);
+			if (errstr) {
+				errx(1, "history size is %s: %s", errstr,
+				    optarg);
+			}
+			break;
 		case 'i':
 			idle_timeout = strtonum(optarg, 30, 60*60*24, &errstr);
 			if (errstr) {
@@ -1409,9 +1479,47 @@ main(int argc, char *argv[])
 		case 'k':
 			kbd_layout = optarg;
 			break;
+		case 'l':
+			readlimit = strtonum(optarg, 4, 64*1024, &errstr);
+			if (errstr) {
+				errx(1, "read limit is %s: %s", errstr,
+				    optarg);
+			}
+			readlimit *= 1024;
+			break;
+		case 'm':
+			maxstale = strtonum(optarg, 0, 1000, &errstr);
+			if (errstr) {
+				errx(1, "maximum staleness is %s: %s", errstr,
+				    optarg);
+			}
+			break;
+		case 'N':
+			nterms = strtonum(optarg, 1, MAXTERMS, &errstr);
+			if (errstr) {
+				errx(1, "number of terminals is %s: %s",
+				    errstr, optarg);
+			}
+			break;
 		case 'o':
 			kbd_options = optarg;
 			break;
+		case 'p':
+			replayfile = optarg;
+			break;
+		case 'P':
+			histfile = optarg;
+			break;
+		case 'R':
+			recfile = optarg;
+			break;
+		case 'T':
+			nworkers = strtonum(optarg, 0, MAXTERMS, &errstr);
+			if (errstr) {
+				errx(1, "number of worker threads is %s: %s",
+				    errstr, optarg);
+			}
+			break;
 		case 'r':
 			repeat_rate = strtonum(optarg, 1, 50, &errstr);
 			if (errstr) {
@@ -1426,17 +1534,36 @@ main(int argc, char *argv[])
 				    optarg);
 			}
 			break;
+		case 'S':
+			shadow = true;
+			break;
+		case 't':
+			nrenderers = strtonum(optarg, 1, MAXRENDERERS + 1,
+			    &errstr) - 1;
+			if (errstr) {
+				errx(1, "number of drawing threads is %s: %s",
+				    errstr, optarg);
+			}
+			break;
 		case 'v':
 			kbd_variant = optarg;
 			break;
 		case 'w':
 			whitebg = true;
 			break;
+		case 'x':
+			replayfast = true;
+			break;
 		case 'h':
 		default:
 			usage();
 		}
 	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		cmdargv = argv;
+	headless = backend == &headless_backend;
 
 	repdelay.tv_sec = repeat_delay / 1000;
 	repdelay.tv_usec = (repeat_delay % 1000) * 1000;
@@ -1444,7 +1571,8 @@ main(int argc, char *argv[])
 	reprate.tv_sec = ((1000*1000) / repeat_rate) / (1000*1000);
 	reprate.tv_usec = ((1000*1000) / repeat_rate) % (1000*1000);
 
-	xkb_init(kbd_layout, kbd_options, kbd_variant);
+	if (!headless)
+		xkb_init(kbd_layout, kbd_options, kbd_variant);
 
 	/*
 	 * Font settings. alpha=true can only be used for truetype fonts
@@ -1485,90 +1613,87 @@ main(int argc, char *argv[])
 	if (normalfont == NULL)
 		normalfont = default_normalfont;
 
-	char termenv[] = "TERM=xterm";
-	char defaultshell[] = "/bin/sh";
-
-	memset(&term, 0, sizeof(term));
-	curterm = &term;
-	term.winsz = (struct winsize){
-		24, 80, 8 * 24, 16 * 80
-	};
-	/*
-	 * XXX This should rather come at the end of initialization because
-	 *     it usually will never fail.
-	 */
-	term.child = forkpty(&term.amaster, NULL, NULL, &term.winsz);
-	if (term.child == -1) {
-		err(EXIT_FAILURE, "forkpty");
-	} else if (term.child == 0) {
-		shell = getenv("SHELL");
-		if (shell == NULL)
-			shell = defaultshell;
-		putenv(termenv);
-		if (execlp(shell, basename(shell), NULL) == -1)
-			err(EXIT_FAILURE, "execlp");
-	}
-
-	set_nonblocking(term.amaster);
-
-	teken_init(&term.tek, &tek_funcs, &term);
-	if (whitebg)
-		teken_set_defattr(&term.tek, &white_defattr);
-	else
-		teken_set_defattr(&term.tek, &defattr);
+	termattr = whitebg ? &white_defattr : &defattr;
 
 	/* XXX handle errors (e.g. when invalid font paths are given) */
 	rop = rop32_init(normalfont, boldfont, fontheight,
 	    &fnwidth, &fnheight, alpha);
 	if (rop == NULL)
 		errx(1, "rop32_init failed, aborting");
-
-	if (drm_backend_init(&gfxstate) != 0) {
-		errx(1, "Failed to initialize drm backend");
+	if (cachesize >= 0)
+		rop32_setcachesize(rop, (size_t)cachesize * 1024);
+
+	if (backend->init() != 0)
+		errx(1, "Failed to initialize %s backend", backend->name);
+	for (i = 0; i < nfbs; i++) {
+		if (backend->allocfb(&framebuffers[i]) != 0)
+			errx(1, "Failed to allocate framebuffer");
 	}
-	drm_backend_allocfb(&gfxstate, &framebuffer);
 	rop32_setclip(rop, (point){0,0},
-	    (point){framebuffer.width, framebuffer.height});
-	rop32_setcontext(rop, framebuffer.plane, framebuffer.width);
-
-	vtconfigure();
-	drm_backend_show(&gfxstate, &framebuffer);
-
-	winsize.tp_col = framebuffer.width / fnwidth;
-	winsize.tp_row = framebuffer.height / fnheight;
-//	winsize.tp_col = 80;
-//	winsize.tp_row = 25;
-	teken_set_winsize(&term.tek, &winsize);
-        term.winsz.ws_col = winsize.tp_col;
-        term.winsz.ws_row = winsize.tp_row;
-        term.winsz.ws_xpixel = term.winsz.ws_col * fnwidth;
-        term.winsz.ws_ypixel = term.winsz.ws_row * fnheight;
-	ioctl (term.amaster, TIOCSWINSZ, &term.winsz);
-	term.buf = calloc(term.winsz.ws_col * term.winsz.ws_row,
-	    sizeof(struct bufent));
-	oldbuf = calloc(term.winsz.ws_col * term.winsz.ws_row,
-	    sizeof(struct bufent));
-	dirtybuf = calloc(term.winsz.ws_col * term.winsz.ws_row,
-	    sizeof(uint32_t));
-	term.keypad = 0;
-	term.showcursor = 1;
+	    (point){framebuffers[0].width, framebuffers[0].height});
+	if (shadow) {
+		shadowbuf = calloc(framebuffers[0].width *
+		    framebuffers[0].height, sizeof(uint32_t));
+		if (shadowbuf == NULL)
+			err(1, "calloc");
+	}
+	for (i = 0; i < (int)nrenderers; i++) {
+		renderers[i].rop = rop32_init(normalfont, boldfont, fontheight,
+		    &fnwidth, &fnheight, alpha);
+		if (renderers[i].rop == NULL)
+			errx(1, "rop32_init failed, aborting");
+		if (cachesize >= 0) {
+			rop32_setcachesize(renderers[i].rop,
+			    (size_t)cachesize * 1024);
+		}
+		rop32_setclip(renderers[i].rop, (point){0,0},
+		    (point){framebuffers[0].width, framebuffers[0].height});
+	}
+	if (shadow) {
+		set_drawcontext(shadowbuf, framebuffers[0].width);
+	} else {
+		set_drawcontext(framebuffers[0].plane,
+		    framebuffers[0].pitch / sizeof(uint32_t));
+	}
+
+	if (!headless)
+		vtconfigure();
+	backend->show(&framebuffers[0]);
+
+	cols = framebuffers[0].width / fnwidth;
+	rows = framebuffers[0].height / fnheight;
+	if (redraw_init(cols, rows, termattr) != 0)
+		errx(1, "Failed to allocate terminal buffer");
+	if (recfile != NULL) {
+		recorder = record_open(recfile, cols, rows);
+		if (recorder == NULL)
+			err(1, "%s", recfile);
+	}
+	for (i = 0; i < nfbs; i++) {
+		fbdamage[i] = calloc(rows, sizeof(struct rowdamage));
+		if (fbdamage[i] == NULL)
+			err(1, "calloc");
+	}
 
 	/* Resetting character cells to a default value */
-	uint32_t k;
-	for (k = 0; k < framebuffer.width * framebuffer.height; k++) {
-		((uint32_t *)framebuffer.plane)[k] =
-		    colormap[teken_get_defattr(&term.tek)->ta_bgcolor];
+	uint32_t k, l;
+	for (i = 0; i < nfbs; i++) {
+		for (k = 0; k < framebuffers[i].height; k++) {
+			uint32_t *line = (uint32_t *)
+			    ((uint8_t *)framebuffers[i].plane +
+			    k * framebuffers[i].pitch);
+			for (l = 0; l < framebuffers[i].width; l++)
+				line[l] = colormap[termattr->ta_bgcolor];
+		}
 	}
-	for (i = 0; i < term.winsz.ws_col * term.winsz.ws_row; i++) {
-		term.buf[i].attr = *teken_get_defattr(&term.tek);
-		term.buf[i].ch = ' ';
-		term.buf[i].cursor = 0;
-		term.buf[i].dirty = 0;
+	if (shadowbuf != NULL) {
+		for (k = 0; k < framebuffers[0].width *
+		    framebuffers[0].height; k++) {
+			shadowbuf[k] = colormap[termattr->ta_bgcolor];
+		}
 	}
-	memcpy(oldbuf, term.buf,
-	    term.winsz.ws_col * term.winsz.ws_row * sizeof(*term.buf));
 
-	struct event *masterev, *ttyev, *drmev, *vtrelev, *vtacqev, *sigintev;
+	struct event *ttyev, *vtrelev, *vtacqev, *sigintev;
 
 	evbase = event_base_new();
 
@@ -1580,7 +1705,7 @@ main(int argc, char *argv[])
 	 *     ||            3 automatic key-repeat input from the terminal
 	 *     ||            2 keyboard input from the terminal
 	 *     ||            2 output to the master fd of the pty device
-	 *     vv            1 vblank events from the drm device
+	 *     vv            1 vblank events from the output backend
 	 * Highest priority: 0 signal handlers
 	 */
 	event_base_priority_init(evbase, 6);
@@ -1591,10 +1716,6 @@ main(int argc, char *argv[])
 		event_priority_set(idleev, 5);
 	}
 
-	masterev = event_new(evbase, term.amaster,
-	    EV_READ | EV_PERSIST, rdmaster, &term);
-	event_priority_set(masterev, 4);
-
 	repeatev = evtimer_new(evbase, keyrepeat, NULL);
 	event_priority_set(repeatev, 3);
 
@@ -1604,9 +1725,8 @@ main(int argc, char *argv[])
 
 	/* XXX event handler for writes to the master fd of the pty device */
 
-	drmev = event_new(evbase, gfxstate.fd,
-	    EV_READ | EV_PERSIST, drmread, NULL);
-	event_priority_set(drmev, 1);
+	if (backend->attach(evbase) != 0)
+		errx(1, "Failed to set up %s backend events", backend->name);
 
 	vtrelev = evsignal_new(evbase, SIGUSR1, vtrelease, NULL);
 	event_priority_set(vtrelev, 0);
@@ -1618,47 +1738,75 @@ main(int argc, char *argv[])
 	sigintev = evsignal_new(evbase, SIGINT, handleterm, NULL);
 	event_priority_set(sigintev, 0);
 
+	for (i = 0; i < (int)nterms; i++)
+		pthread_mutex_init(&terms[i].lock, NULL);
+	if (term_start(0) != 0)
+		errx(1, "Failed to start the terminal");
+	curterm = &terms[0];
+	curterm->shown = true;
+	/* The shown terminal is always parsed by the main thread */
+	nworkers = MIN(nworkers, nterms - 1);
+	if (nworkers > 0)
+		workers_start();
+	if (nrenderers > 0)
+		renderers_start();
+
 	if (idleev != NULL && active)
 		event_add(idleev, &idletv);
-	event_add(masterev, NULL);
-	event_add(ttyev, NULL);
-	event_add(drmev, NULL);
-	event_add(vtrelev, NULL);
-	event_add(vtacqev, NULL);
+	if (!headless) {
+		event_add(ttyev, NULL);
+		event_add(vtrelev, NULL);
+		event_add(vtacqev, NULL);
+	}
 	event_add(sigintev, NULL);
 
 	event_base_loop(evbase, 0);
 	signal(SIGINT, SIG_DFL);
-	drm_set_dpms(&gfxstate, DRM_MODE_DPMS_ON);
+	if (headless)
+		flush_frames();
+	backend->set_dpms(true);
 
 	event_del(sigintev);
 	event_del(vtacqev);
 	event_del(vtrelev);
-	event_del(drmev);
 	event_del(ttyev);
 	event_del(repeatev);
-	event_del(masterev);
 	if (idleev != NULL)
 		event_del(idleev);
 
 	event_free(sigintev);
 	event_free(vtacqev);
 	event_free(vtrelev);
-	event_free(drmev);
 	event_free(ttyev);
 	event_free(repeatev);
-	event_free(masterev);
 	if (idleev != NULL)
 		event_free(idleev);
+	backend->detach();
+	if (nworkers > 0)
+		workers_stop();
+	if (nrenderers > 0)
+		renderers_stop();
+	for (i = 0; i < (int)nterms; i++) {
+		if (terms[i].started)
+			term_stop(&terms[i]);
+		pthread_mutex_destroy(&terms[i].lock);
+	}
 	event_base_free(evbase);
-
-	free(term.buf);
-	free(oldbuf);
-
-	drm_backend_hide(&gfxstate);
-	vtdeconf();
-	drm_backend_destroyfb(&gfxstate, &framebuffer);
-	drm_backend_finish(&gfxstate);
-
-	xkb_finish();
+	if (recorder != NULL)
+		record_close(recorder);
+
+	redraw_free();
+	free(shadowbuf);
+	for (i = 0; i < nfbs; i++)
+		free(fbdamage[i]);
+
+	backend->hide();
+	if (!headless)
+		vtdeconf();
+	for (i = 0; i < nfbs; i++)
+		backend->destroyfb(&framebuffers[i]);
+	backend->finish();
+
+	if (!headless)
+		xkb_finish();
 }
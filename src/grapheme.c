@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grapheme.h"
+
+/*
+ * The clusters are stored in chunks, which are never moved, so that the
+ * renderers can look up the ids in the cells they draw without locking,
+ * while workers intern new clusters. The ids are found by their contents
+ * in an open addressing hash table.
+ *
+ * Unused clusters are freed by a mark and sweep pass of the main thread,
+ * over all the cells which may hold ids, while no terminal is parsed. It
+ * is requested whenever the table has to grow beyond twice the clusters
+ * which survived the previous pass. Once all ids are taken, further marks
+ * are dropped.
+ */
+#define CHUNKSIZE	1024
+#define NCHUNKS		(GRAPHEME_FLAG / CHUNKSIZE)
+#define MAXIDS		(NCHUNKS * CHUNKSIZE)
+#define MINLIMIT	(4 * CHUNKSIZE)
+#define CHMASK		((UINT64_C(1) << GRAPHEME_CHBITS) - 1)
+
+struct grapheme {
+	uint32_t c[GRAPHEME_MAXLEN];	/* c[0] links free entries */
+	uint8_t len;			/* 0 when free */
+	bool marked;
+};
+
+static struct grapheme *chunks[NCHUNKS];
+static uint32_t nids;			/* ids in the allocated chunks */
+static uint32_t nextid;			/* ids below have been used */
+static uint32_t freeid;			/* first free id + 1, or 0 */
+static uint32_t limit = MINLIMIT;
+static uint32_t *hash;			/* id + 1, or 0 */
+static uint32_t hashmask;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool gcwanted;
+
+static inline struct grapheme *
+entry(uint32_t id)
+{
+	return &chunks[id / CHUNKSIZE][id % CHUNKSIZE];
+}
+
+static uint32_t
+hashcluster(const uint32_t *c, unsigned int len)
+{
+	uint32_t h = len;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ c[i]) * 0x9e3779b1;
+	return h ^ (h >> 15);
+}
+
+/* Slot of the id of the cluster, or the empty slot where it would go */
+static uint32_t *
+lookup(const uint32_t *c, unsigned int len)
+{
+	struct grapheme *g;
+	uint32_t i;
+
+	i = hashcluster(c, len) & hashmask;
+	for (;;) {
+		if (hash[i] == 0)
+			return &hash[i];
+		g = entry(hash[i] - 1);
+		if (g->len == len && memcmp(g->c, c, len * sizeof(*c)) == 0)
+			return &hash[i];
+		i = (i + 1) & hashmask;
+	}
+}
+
+/*
+ * Rebuild the hash table for the ids which are in use, keeping it at most
+ * half full for all the allocated ids.
+ */
+static int
+rehash(void)
+{
+	struct grapheme *g;
+	uint32_t id, n;
+
+	for (n = 2 * CHUNKSIZE; n < 2 * nids; n <<= 1)
+		;
+	if (hash == NULL || n - 1 != hashmask) {
+		free(hash);
+		hash = calloc(n, sizeof(*hash));
+		if (hash == NULL) {
+			hashmask = 0;
+			return 1;
+		}
+		hashmask = n - 1;
+	} else {
+		memset(hash, 0, n * sizeof(*hash));
+	}
+	for (id = 0; id < nextid; id++) {
+		g = entry(id);
+		if (g->len > 0)
+			*lookup(g->c, g->len) = id + 1;
+	}
+	return 0;
+}
+
+/* Take a free id, or return MAXIDS if there are none left */
+static uint32_t
+newid(void)
+{
+	uint32_t id;
+
+	if (freeid != 0) {
+		id = freeid - 1;
+		freeid = entry(id)->c[0];
+		return id;
+	}
+	if (nextid == nids) {
+		if (nids == MAXIDS || hash == NULL)
+			return MAXIDS;
+		if (nids >= limit)
+			atomic_store(&gcwanted, true);
+		chunks[nids / CHUNKSIZE] = calloc(CHUNKSIZE,
+		    sizeof(struct grapheme));
+		if (chunks[nids / CHUNKSIZE] == NULL)
+			return MAXIDS;
+		nids += CHUNKSIZE;
+		if (rehash() != 0)
+			return MAXIDS;
+	}
+	return nextid++;
+}
+
+/* Return the id of the cluster of len characters, or MAXIDS on failure */
+static uint32_t
+intern(const uint32_t *c, unsigned int len)
+{
+	uint32_t *slot, id;
+
+	pthread_mutex_lock(&lock);
+	if (hash == NULL && rehash() != 0) {
+		pthread_mutex_unlock(&lock);
+		return MAXIDS;
+	}
+	slot = lookup(c, len);
+	if (*slot == 0) {
+		id = newid();
+		if (id == MAXIDS) {
+			pthread_mutex_unlock(&lock);
+			return MAXIDS;
+		}
+		memcpy(entry(id)->c, c, len * sizeof(*c));
+		entry(id)->len = len;
+		/* Growing the table rehashes */
+		*lookup(c, len) = id + 1;
+	} else {
+		id = *slot - 1;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return id;
+}
+
+/*
+ * Return the id of the cluster of the character or cluster ch, followed by
+ * the character c. If that isn't possible, ch is returned unchanged.
+ */
+uint32_t
+grapheme_append(uint32_t ch, uint32_t c)
+{
+	uint32_t buf[GRAPHEME_MAXLEN], id;
+	unsigned int len;
+
+	len = grapheme_get(ch, buf);
+	if (len == GRAPHEME_MAXLEN)
+		return ch;
+	buf[len++] = c;
+
+	id = intern(buf, len);
+	return id == MAXIDS ? ch : id | GRAPHEME_FLAG;
+}
+
+/*
+ * Return the character or cluster made of the len characters in c, where
+ * 0 < len <= GRAPHEME_MAXLEN. If that isn't possible, only the first
+ * character is returned.
+ */
+uint32_t
+grapheme_intern(const uint32_t *c, unsigned int len)
+{
+	uint32_t id;
+
+	if (len == 1)
+		return c[0];
+	id = intern(c, len);
+	return id == MAXIDS ? c[0] : id | GRAPHEME_FLAG;
+}
+
+/*
+ * Store the characters of the character or cluster ch in c, which has room
+ * for GRAPHEME_MAXLEN of them, and return their number.
+ */
+unsigned int
+grapheme_get(uint32_t ch, uint32_t *c)
+{
+	struct grapheme *g;
+
+	if (!(ch & GRAPHEME_FLAG)) {
+		c[0] = ch;
+		return 1;
+	}
+	g = entry(ch & ~GRAPHEME_FLAG);
+	memcpy(c, g->c, g->len * sizeof(*c));
+	return g->len;
+}
+
+/* Whether the main thread should run a mark and sweep pass */
+bool
+grapheme_gcwanted(void)
+{
+	return atomic_load(&gcwanted);
+}
+
+/* Mark the clusters used by n cells, with the characters in the low bits */
+void
+grapheme_mark(const uint64_t *cells, size_t n)
+{
+	uint32_t ch;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		ch = cells[i] & CHMASK;
+		if ((ch & GRAPHEME_FLAG) && (ch & ~GRAPHEME_FLAG) < nextid)
+			entry(ch & ~GRAPHEME_FLAG)->marked = true;
+	}
+}
+
+/* Free the clusters which weren't marked since the last pass */
+void
+grapheme_sweep(void)
+{
+	struct grapheme *g;
+	uint32_t id, live = 0;
+
+	pthread_mutex_lock(&lock);
+	for (id = 0; id < nextid; id++) {
+		g = entry(id);
+		if (g->len > 0 && !g->marked) {
+			g->len = 0;
+			g->c[0] = freeid;
+			freeid = id + 1;
+		} else if (g->len > 0) {
+			live++;
+		}
+		g->marked = false;
+	}
+	if (hash != NULL && rehash() != 0)
+		warnx("Failed to rebuild the grapheme table");
+	limit = MAX(MINLIMIT, 2 * live);
+	atomic_store(&gcwanted, false);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GRAPHEME_H_
+#define _GRAPHEME_H_	0
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A character with combining marks, or a sequence of emoji joined by ZWJ,
+ * is kept in the cells as the id of a grapheme cluster. Clusters are
+ * interned in a table shared by all terminals, so that equal cells always
+ * have equal contents. Ids have GRAPHEME_FLAG set, which lies above all
+ * characters, so cells need GRAPHEME_CHBITS bits for either.
+ */
+#define GRAPHEME_FLAG	0x200000
+#define GRAPHEME_CHBITS	22
+#define GRAPHEME_MAXLEN	8		/* characters in a cluster */
+
+uint32_t grapheme_append(uint32_t, uint32_t);
+uint32_t grapheme_intern(const uint32_t *, unsigned int);
+unsigned int grapheme_get(uint32_t, uint32_t *);
+bool grapheme_gcwanted(void);
+void grapheme_mark(const uint64_t *, size_t);
+void grapheme_sweep(void);
+
+#endif /* !_GRAPHEME_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include <sys/param.h>
+
+#include <event2/event.h>
+
+#include "backend.h"
+
+/*
+ * Headless backend, which draws into framebuffers in ordinary memory. This
+ * allows running and profiling the terminal without a display. Vblanks are
+ * simulated with a 60Hz timer, and page flips complete right away. With
+ * headless_dump set, every flipped frame is written out as a PPM image.
+ */
+uint32_t headless_width = 1920, headless_height = 1080;
+const char *headless_dump = NULL;
+
+static struct timeval frametv = { .tv_sec = 0, .tv_usec = 16667 };
+static struct event *vblankev, *flipev;
+static unsigned int nframes;
+static uint8_t *dumpline;
+
+static int
+headless_init(void)
+{
+	if (headless_dump != NULL) {
+		dumpline = malloc(headless_width * 3);
+		if (dumpline == NULL)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+headless_finish(void)
+{
+	free(dumpline);
+	dumpline = NULL;
+}
+
+static int
+headless_allocfb(struct framebuffer *fb)
+{
+	fb->width = headless_width;
+	fb->height = headless_height;
+	fb->pitch = fb->width * sizeof(uint32_t);
+	fb->plane = calloc(fb->height, fb->pitch);
+	if (fb->plane == NULL)
+		return 1;
+	return 0;
+}
+
+static void
+headless_destroyfb(struct framebuffer *fb)
+{
+	free(fb->plane);
+	fb->plane = NULL;
+}
+
+static void
+dump_frame(const struct framebuffer *fb)
+{
+	const uint32_t *line;
+	char *path;
+	FILE *f;
+	uint32_t x, y;
+
+	if (asprintf(&path, "%s%06u.ppm", headless_dump, nframes) == -1)
+		return;
+	f = fopen(path, "w");
+	if (f == NULL) {
+		warn("%s", path);
+		free(path);
+		return;
+	}
+	fprintf(f, "P6\n%u %u\n255\n", fb->width, fb->height);
+	for (y = 0; y < fb->height; y++) {
+		line = (const uint32_t *)((uint8_t *)fb->plane +
+		    y * fb->pitch);
+		for (x = 0; x < fb->width; x++) {
+			dumpline[3 * x] = line[x] >> 16;
+			dumpline[3 * x + 1] = line[x] >> 8;
+			dumpline[3 * x + 2] = line[x];
+		}
+		fwrite(dumpline, 3, fb->width, f);
+	}
+	if (fclose(f) != 0)
+		warn("%s", path);
+	free(path);
+}
+
+static int
+headless_show(struct framebuffer *fb __unused)
+{
+	return 0;
+}
+
+static int
+headless_hide(void)
+{
+	return 0;
+}
+
+static int
+headless_flip(struct framebuffer *fb)
+{
+	if (headless_dump != NULL)
+		dump_frame(fb);
+	nframes++;
+	/* Complete the flip from the event loop, not recursively */
+	event_active(flipev, EV_TIMEOUT, 0);
+	return 0;
+}
+
+static int
+headless_wait_vblank(void)
+{
+	return event_add(vblankev, &frametv);
+}
+
+static void
+headless_set_dpms(bool on __unused)
+{
+}
+
+static void
+vblankfired(evutil_socket_t fd __unused, short events __unused,
+    void *arg __unused)
+{
+	handle_vblank();
+}
+
+static void
+flipfired(evutil_socket_t fd __unused, short events __unused,
+    void *arg __unused)
+{
+	handle_page_flip();
+}
+
+static int
+headless_attach(struct event_base *base)
+{
+	vblankev = evtimer_new(base, vblankfired, NULL);
+	flipev = evtimer_new(base, flipfired, NULL);
+	if (vblankev == NULL || flipev == NULL)
+		return 1;
+	event_priority_set(vblankev, 1);
+	event_priority_set(flipev, 1);
+	return 0;
+}
+
+static void
+headless_detach(void)
+{
+	event_free(vblankev);
+	event_free(flipev);
+	vblankev = flipev = NULL;
+}
+
+const struct backend headless_backend = {
+	.name = "headless",
+	.init = headless_init,
+	.finish = headless_finish,
+	.allocfb = headless_allocfb,
+	.destroyfb = headless_destroyfb,
+	.show = headless_show,
+	.hide = headless_hide,
+	.flip = headless_flip,
+	.wait_vblank = headless_wait_vblank,
+	.set_dpms = headless_set_dpms,
+	.attach = headless_attach,
+	.detach = headless_detach
+};
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "grapheme.h"
+#include "history.h"
+
+/*
+ * Rows are collected uncompressed in the current chunk, which gets
+ * compressed once it is full. The oldest compressed chunks are dropped
+ * when the memory limit is exceeded.
+ *
+ * A compressed row is a sequence of runs. Each run starts with a varint of
+ * (length << 1 | repeat), followed by a varint of the attributes shared by
+ * all cells of the run. A repeat run then has a single character for all
+ * of its cells, other runs have one character per cell, also as varints.
+ * Grapheme clusters are stored as CLUSTER + their length, followed by their
+ * characters, so that the compressed rows hold no cluster ids.
+ *
+ * Optionally, dropped chunks are appended to a history file instead, in the
+ * same format. A separate index file holds the 64-bit file offset of each
+ * chunk, and chunks are mmap(2)ed one at a time when they are read back.
+ */
+#define CHUNKROWS	64
+#define MINREPEAT	3
+#define MAXCELLBYTES	(16 + 3 * GRAPHEME_MAXLEN)
+#define CLUSTER		0x110000	/* above all characters */
+#define CHMASK		((UINT64_C(1) << HISTORY_CHBITS) - 1)
+
+struct histchunk {
+	uint32_t off[CHUNKROWS + 1];	/* start of each row in data */
+	uint8_t data[];
+};
+
+struct history {
+	unsigned int cols;
+	size_t limit;			/* in bytes */
+	size_t mem;			/* bytes currently used */
+	struct histchunk **chunks;	/* ring of compressed chunks */
+	unsigned int head, nchunks, maxchunks;
+	uint64_t *cur;			/* rows of the chunk being filled */
+	unsigned int ncur;
+	uint8_t *scratch;		/* for compressing a chunk */
+	int datafd, indexfd;		/* history file, or -1 */
+	uint64_t filesize;
+	unsigned int nfile;		/* chunks in the history file */
+	unsigned int mapped;		/* chunk mapped at map, if maplen > 0 */
+	void *map;
+	size_t maplen;
+	const struct histchunk *mapchunk;
+};
+
+static size_t
+put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+/* Store the character or cluster of the cell c */
+static size_t
+put_char(uint8_t *p, uint64_t c)
+{
+	uint32_t buf[GRAPHEME_MAXLEN];
+	unsigned int i, len;
+	size_t n;
+
+	if (!(c & GRAPHEME_FLAG))
+		return put_varint(p, c & CHMASK);
+	len = grapheme_get(c & CHMASK, buf);
+	n = put_varint(p, CLUSTER + len);
+	for (i = 0; i < len; i++)
+		n += put_varint(&p[n], buf[i]);
+
+	return n;
+}
+
+static uint64_t
+get_varint(const uint8_t **pp)
+{
+	const uint8_t *p = *pp;
+	uint64_t v = 0;
+	int shift = 0;
+
+	do {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*pp = p;
+
+	return v;
+}
+
+static uint32_t
+get_char(const uint8_t **pp)
+{
+	uint32_t buf[GRAPHEME_MAXLEN];
+	uint64_t v;
+	unsigned int i, len;
+
+	v = get_varint(pp);
+	if (v < CLUSTER)
+		return v;
+	len = v - CLUSTER;
+	for (i = 0; i < len; i++)
+		buf[MIN(i, GRAPHEME_MAXLEN - 1)] = get_varint(pp);
+
+	return grapheme_intern(buf, MIN(len, GRAPHEME_MAXLEN));
+}
+
+/* Length of the run of identical cells starting at c[i] */
+static unsigned int
+runlen(const uint64_t *c, unsigned int i, unsigned int cols)
+{
+	unsigned int j;
+
+	for (j = i + 1; j < cols && c[j] == c[i]; j++)
+		;
+	return j - i;
+}
+
+static size_t
+encode_row(const uint64_t *c, unsigned int cols, uint8_t *p)
+{
+	uint8_t *start = p;
+	uint64_t attr;
+	unsigned int i = 0, j, n;
+
+	while (i < cols) {
+		attr = c[i] >> HISTORY_CHBITS;
+		n = runlen(c, i, cols);
+		if (n >= MINREPEAT) {
+			p += put_varint(p, (uint64_t)n << 1 | 1);
+			p += put_varint(p, attr);
+			p += put_char(p, c[i]);
+			i += n;
+			continue;
+		}
+		/* Up to the next attribute change, or the next repeat run */
+		for (j = i + n; j < cols; j++) {
+			if (c[j] >> HISTORY_CHBITS != attr ||
+			    runlen(c, j, cols) >= MINREPEAT)
+				break;
+		}
+		p += put_varint(p, (uint64_t)(j - i) << 1);
+		p += put_varint(p, attr);
+		for (; i < j; i++)
+			p += put_char(p, c[i]);
+	}
+
+	return p - start;
+}
+
+static void
+decode_row(const uint8_t *p, unsigned int cols, uint64_t *c)
+{
+	uint64_t hdr, attr, ch;
+	unsigned int i = 0, n;
+
+	while (i < cols) {
+		hdr = get_varint(&p);
+		attr = get_varint(&p) << HISTORY_CHBITS;
+		n = MIN(hdr >> 1, cols - i);
+		if (n == 0)
+			break;
+		if (hdr & 1) {
+			ch = get_char(&p);
+			while (n-- > 0)
+				c[i++] = attr | ch;
+		} else {
+			while (n-- > 0)
+				c[i++] = attr | get_char(&p);
+		}
+	}
+}
+
+static void
+history_drop(struct history *h)
+{
+	struct histchunk *c;
+
+	c = h->chunks[h->head];
+	h->mem -= sizeof(*c) + c->off[CHUNKROWS];
+	free(c);
+	h->head = (h->head + 1) % h->maxchunks;
+	h->nchunks--;
+}
+
+static int
+history_grow(struct history *h)
+{
+	struct histchunk **chunks;
+	unsigned int i, n;
+
+	n = h->maxchunks > 0 ? h->maxchunks * 2 : 16;
+	chunks = calloc(n, sizeof(*chunks));
+	if (chunks == NULL)
+		return 1;
+	for (i = 0; i < h->nchunks; i++)
+		chunks[i] = h->chunks[(h->head + i) % h->maxchunks];
+	free(h->chunks);
+	h->chunks = chunks;
+	h->head = 0;
+	h->maxchunks = n;
+
+	return 0;
+}
+
+static void
+history_unmap(struct history *h)
+{
+	if (h->maplen > 0)
+		munmap(h->map, h->maplen);
+	h->maplen = 0;
+}
+
+static void
+history_closefile(struct history *h)
+{
+	history_unmap(h);
+	if (h->datafd != -1) {
+		close(h->datafd);
+		close(h->indexfd);
+	}
+	h->datafd = h->indexfd = -1;
+	h->filesize = 0;
+	h->nfile = 0;
+}
+
+/* Append the oldest chunk to the history file */
+static void
+history_spill(struct history *h)
+{
+	struct histchunk *c = h->chunks[h->head];
+	size_t len = sizeof(*c) + c->off[CHUNKROWS];
+	uint64_t off = h->filesize;
+
+	if (pwrite(h->datafd, c, len, off) != (ssize_t)len ||
+	    pwrite(h->indexfd, &off, sizeof(off),
+	    (off_t)h->nfile * sizeof(off)) != sizeof(off)) {
+		warn("write to history file");
+		history_closefile(h);
+		return;
+	}
+	/* Keep the chunk headers aligned */
+	h->filesize += roundup(len, sizeof(uint64_t));
+	h->nfile++;
+}
+
+/* Map the i-th chunk of the history file */
+static const struct histchunk *
+history_mapchunk(struct history *h, unsigned int i)
+{
+	uint64_t off[2];
+	off_t start;
+	size_t n;
+	void *p;
+
+	if (h->maplen > 0 && h->mapped == i)
+		return h->mapchunk;
+	history_unmap(h);
+
+	n = i + 1 < h->nfile ? 2 : 1;
+	if (pread(h->indexfd, off, n * sizeof(off[0]),
+	    (off_t)i * sizeof(off[0])) != (ssize_t)(n * sizeof(off[0])))
+		return NULL;
+	if (n == 1)
+		off[1] = h->filesize;
+	start = off[0] & ~(uint64_t)(getpagesize() - 1);
+	p = mmap(NULL, off[1] - start, PROT_READ, MAP_SHARED, h->datafd,
+	    start);
+	if (p == MAP_FAILED)
+		return NULL;
+	h->map = p;
+	h->maplen = off[1] - start;
+	h->mapped = i;
+	h->mapchunk = (const struct histchunk *)((uint8_t *)p +
+	    (off[0] - start));
+
+	return h->mapchunk;
+}
+
+/* Compress the full current chunk, and append it to the ring */
+static void
+history_compress(struct history *h)
+{
+	struct histchunk *c;
+	uint32_t off[CHUNKROWS + 1];
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < CHUNKROWS; i++) {
+		off[i] = len;
+		len += encode_row(&h->cur[i * h->cols], h->cols,
+		    &h->scratch[len]);
+	}
+	off[CHUNKROWS] = len;
+	h->ncur = 0;
+
+	/* If we run out of memory, these rows are lost */
+	if (h->nchunks == h->maxchunks && history_grow(h) != 0)
+		return;
+	c = malloc(sizeof(*c) + len);
+	if (c == NULL)
+		return;
+	memcpy(c->off, off, sizeof(off));
+	memcpy(c->data, h->scratch, len);
+	h->chunks[(h->head + h->nchunks) % h->maxchunks] = c;
+	h->nchunks++;
+	h->mem += sizeof(*c) + len;
+
+	while (h->mem > h->limit && h->nchunks > 0) {
+		if (h->datafd != -1)
+			history_spill(h);
+		history_drop(h);
+	}
+}
+
+struct history *
+history_init(unsigned int cols, size_t limit)
+{
+	struct history *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return NULL;
+	h->cur = calloc((size_t)cols * CHUNKROWS, sizeof(*h->cur));
+	h->scratch = malloc((size_t)cols * CHUNKROWS * MAXCELLBYTES);
+	if (h->cur == NULL || h->scratch == NULL) {
+		free(h->cur);
+		free(h->scratch);
+		free(h);
+		return NULL;
+	}
+	h->cols = cols;
+	h->limit = limit;
+	h->datafd = h->indexfd = -1;
+	h->mem = (size_t)cols * CHUNKROWS * sizeof(*h->cur);
+
+	return h;
+}
+
+/*
+ * Keep the chunks dropped from memory in the file at path, and its index in
+ * path.idx. Returns -1 with errno set on failure.
+ */
+int
+history_setfile(struct history *h, const char *path)
+{
+	char *idxpath;
+	int fd, idxfd;
+
+	if (asprintf(&idxpath, "%s.idx", path) == -1)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	idxfd = open(idxpath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	free(idxpath);
+	if (fd == -1 || idxfd == -1) {
+		if (fd != -1)
+			close(fd);
+		if (idxfd != -1)
+			close(idxfd);
+		return -1;
+	}
+	history_closefile(h);
+	h->datafd = fd;
+	h->indexfd = idxfd;
+
+	return 0;
+}
+
+void
+history_free(struct history *h)
+{
+	history_closefile(h);
+	while (h->nchunks > 0)
+		history_drop(h);
+	free(h->chunks);
+	free(h->cur);
+	free(h->scratch);
+	free(h);
+}
+
+/* Append a row, which was scrolled off the screen */
+void
+history_push(struct history *h, const uint64_t *row)
+{
+	memcpy(&h->cur[h->ncur * h->cols], row, h->cols * sizeof(*row));
+	if (++h->ncur == CHUNKROWS)
+		history_compress(h);
+}
+
+unsigned int
+history_rows(const struct history *h)
+{
+	return (h->nfile + h->nchunks) * CHUNKROWS + h->ncur;
+}
+
+/*
+ * Copy the row which was pushed age rows before the most recent one into
+ * row. The age has to be less than history_rows().
+ */
+void
+history_get(struct history *h, unsigned int age, uint64_t *row)
+{
+	const struct histchunk *c;
+	unsigned int i;
+
+	if (age < h->ncur) {
+		memcpy(row, &h->cur[(h->ncur - 1 - age) * h->cols],
+		    h->cols * sizeof(*row));
+		return;
+	}
+	age -= h->ncur;
+	if (age < h->nchunks * CHUNKROWS) {
+		i = h->nchunks - 1 - age / CHUNKROWS;
+		c = h->chunks[(h->head + i) % h->maxchunks];
+	} else {
+		age -= h->nchunks * CHUNKROWS;
+		c = history_mapchunk(h, h->nfile - 1 - age / CHUNKROWS);
+		if (c == NULL) {
+			memset(row, 0, h->cols * sizeof(*row));
+			return;
+		}
+	}
+	i = CHUNKROWS - 1 - age % CHUNKROWS;
+	decode_row(&c->data[c->off[i]], h->cols, row);
+}
+
+/*
+ * Pass the cells of the rows which haven't been compressed yet to fn. Only
+ * these can hold cluster ids.
+ */
+void
+history_scan(struct history *h, void (*fn)(const uint64_t *, size_t))
+{
+	fn(h->cur, (size_t)h->ncur * h->cols);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_	0
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scrollback history of terminal rows. Rows are arrays of packed 64-bit
+ * cells, with the character in the low HISTORY_CHBITS bits and the
+ * attributes in the remaining bits.
+ */
+#define HISTORY_CHBITS	22
+
+struct history;
+
+struct history *history_init(unsigned int, size_t);
+int history_setfile(struct history *, const char *);
+void history_free(struct history *);
+void history_push(struct history *, const uint64_t *);
+unsigned int history_rows(const struct history *);
+void history_get(struct history *, unsigned int, uint64_t *);
+void history_scan(struct history *, void (*)(const uint64_t *, size_t));
+
+#endif /* !_HISTORY_H_ */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/ioctl.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/*
+ * The log starts with RECMAGIC and the terminal size as two varints. Each
+ * record then has varints of the time in microseconds since the previous
+ * record, the terminal index and the length, followed by the bytes that
+ * were read from the pty of that terminal.
+ */
+#define RECMAGIC	"FBTKREC1"
+#define RECBUFSIZE	(64 * 1024)
+
+struct record {
+	FILE *f;
+	pthread_mutex_t lock;		/* workers record their terminals too */
+	struct timespec last;
+	bool failed;
+};
+
+static size_t
+put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+static int
+read_varint(FILE *f, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct record *
+record_open(const char *path, unsigned int cols, unsigned int rows)
+{
+	struct record *r;
+	uint8_t hdr[sizeof(RECMAGIC) - 1 + 20];
+	size_t n;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->f = fopen(path, "w");
+	if (r->f == NULL) {
+		free(r);
+		return NULL;
+	}
+	memcpy(hdr, RECMAGIC, sizeof(RECMAGIC) - 1);
+	n = sizeof(RECMAGIC) - 1;
+	n += put_varint(hdr + n, cols);
+	n += put_varint(hdr + n, rows);
+	if (fwrite(hdr, 1, n, r->f) != n) {
+		fclose(r->f);
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &r->last);
+
+	return r;
+}
+
+void
+record_write(struct record *r, unsigned int term, const void *buf, size_t len)
+{
+	struct timespec now;
+	uint8_t hdr[30];
+	uint64_t us;
+	size_t n;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->failed)
+		goto out;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - r->last.tv_sec) * 1000000 +
+	    (now.tv_nsec - r->last.tv_nsec) / 1000;
+	/* Keep the remainder, so that rounding errors don't add up */
+	r->last.tv_sec += us / 1000000;
+	r->last.tv_nsec += (us % 1000000) * 1000;
+	if (r->last.tv_nsec >= 1000000000) {
+		r->last.tv_sec++;
+		r->last.tv_nsec -= 1000000000;
+	}
+	n = put_varint(hdr, us);
+	n += put_varint(hdr + n, term);
+	n += put_varint(hdr + n, len);
+	if (fwrite(hdr, 1, n, r->f) != n || fwrite(buf, 1, len, r->f) != len) {
+		warn("write to record file");
+		r->failed = true;
+	}
+out:
+	pthread_mutex_unlock(&r->lock);
+}
+
+void
+record_close(struct record *r)
+{
+	if (fclose(r->f) != 0)
+		warn("write to record file");
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+/*
+ * Write the output which was recorded for terminal term to the standard
+ * output, which is the pty of the terminal, either as fast as possible or
+ * with the original timing. The pty is set to raw mode, so that the bytes
+ * arrive unchanged.
+ */
+int
+record_replay(const char *path, unsigned int term, bool fast)
+{
+	char magic[sizeof(RECMAGIC) - 1];
+	struct timespec start, now, ts;
+	struct termios tios;
+	struct winsize ws;
+	uint64_t cols, rows, us, t, len, when = 0;
+	char *buf;
+	FILE *f;
+	int64_t wait;
+	size_t n;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		warn("%s", path);
+		return 1;
+	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, RECMAGIC, sizeof(magic)) != 0 ||
+	    read_varint(f, &cols) != 0 || read_varint(f, &rows) != 0) {
+		warnx("%s: not a record file", path);
+		fclose(f);
+		return 1;
+	}
+	buf = malloc(RECBUFSIZE);
+	if (buf == NULL) {
+		warn("malloc");
+		fclose(f);
+		return 1;
+	}
+	if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 &&
+		    (ws.ws_col != cols || ws.ws_row != rows)) {
+			warnx("recorded with %ux%u cells, replaying with %ux%u",
+			    (unsigned)cols, (unsigned)rows, ws.ws_col,
+			    ws.ws_row);
+		}
+		cfmakeraw(&tios);
+		tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (read_varint(f, &us) == 0) {
+		if (read_varint(f, &t) != 0 || read_varint(f, &len) != 0)
+			goto truncated;
+		when += us;
+		if (t != term) {
+			if (fseeko(f, len, SEEK_CUR) != 0)
+				goto truncated;
+			continue;
+		}
+		if (!fast) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait = (int64_t)when -
+			    ((now.tv_sec - start.tv_sec) * 1000000 +
+			    (now.tv_nsec - start.tv_nsec) / 1000);
+			if (wait > 0) {
+				ts.tv_sec = wait / 1000000;
+				ts.tv_nsec = (wait % 1000000) * 1000;
+				nanosleep(&ts, NULL);
+			}
+		}
+		while (len > 0) {
+			n = fread(buf, 1, MIN(len, RECBUFSIZE), f);
+			if (n == 0)
+				goto truncated;
+			if (write_all(STDOUT_FILENO, buf, n) != 0) {
+				free(buf);
+				fclose(f);
+				return 1;
+			}
+			len -= n;
+		}
+	}
+	free(buf);
+	fclose(f);
+	return 0;
+
+truncated:
+	warnx("%s: truncated record file", path);
+	free(buf);
+	fclose(f);
+	return 1;
+}
@@ -33,6 +33,11 @@
 #include <string.h>
 #include <time.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define ROP32_X86
+#endif
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_CACHE_H
@@ -44,6 +49,20 @@ typedef struct MyFaceRec_ {
 	int		 face_index;
 } MyFaceRec, *MyFace;
 
+/*
+ * A fully rendered character cell (background, glyphs and underline) of
+ * fontwidth * fontheight pixels.
+ */
+struct celltile {
+	uint32_t c[ROP32_MAXCHARS];
+	unsigned int nc;
+	int flags;
+	color fg, bg;
+	struct celltile *hnext;			/* hash chain */
+	struct celltile *lprev, *lnext;		/* LRU list, newest first */
+	uint32_t px[];
+};
+
 struct rop_obj {
 	uint32_t *fb;
 
@@ -65,14 +84,30 @@ struct rop_obj {
 	uint32_t cmap_idx;
 
 	bool doalpha;
+	void (*alphaexpand)(void *, int, uint8_t *, int, int, int, int, int,
+	    color, color);
+
+	/* Cell tile cache */
+	struct celltile **tilehash;
+	uint32_t tilehashmask;
+	struct celltile tilelru;		/* list head */
+	size_t tilesize, tilemem, tilemax;
 };
 
+#define ROP32_DEFCACHESIZE	(4 << 20)
+
 static void rop32_drawhoriz(struct rop_obj *, point, point, color);
 static void rop32_drawvert(struct rop_obj *, point, point, color);
 static FT_Error my_face_requester(FTC_FaceID, FT_Library, FT_Pointer,
     FT_Face *);
 static void rop32_alphaexpand(void *, int, uint8_t *, int, int, int, int, int,
     color, color);
+#ifdef ROP32_X86
+static void rop32_alphaexpand_sse2(void *, int, uint8_t *, int, int, int, int,
+    int, color, color);
+static void rop32_alphaexpand_avx2(void *, int, uint8_t *, int, int, int, int,
+    int, color, color);
+#endif
 static void rop32_blit8_aa(struct rop_obj *, point, uint8_t *, int, int,
     int, color, color);
 static void rop32_monoexpand(void *, int, uint8_t *, int, int, int, int, int,
@@ -130,6 +165,14 @@ rop32_init(char *fp, char *boldfp, int h, int *fn_width, int *fn_height,
 	int error;
 
 	self->doalpha = alpha;
+	self->alphaexpand = rop32_alphaexpand;
+#ifdef ROP32_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		self->alphaexpand = rop32_alphaexpand_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		self->alphaexpand = rop32_alphaexpand_sse2;
+#endif
 
 	if (fp == NULL && boldfp == NULL)
 		boldfp = default_boldfp;
@@ -241,9 +284,50 @@ skipbold:
 	}
 skipboldscaler:
 
+	self->tilelru.lprev = self->tilelru.lnext = &self->tilelru;
+	self->tilesize = sizeof(struct celltile) +
+	    self->fontwidth * self->fontheight * sizeof(uint32_t);
+	rop32_setcachesize(self, ROP32_DEFCACHESIZE);
+
 	return self;
 }
 
+/*
+ * Limit the memory used for caching rendered cells to size bytes.
+ * A size of 0 disables the cache. This drops all cached cells.
+ */
+void
+rop32_setcachesize(struct rop_obj *self, size_t size)
+{
+	struct celltile *tile, *next;
+	size_t n;
+
+	for (tile = self->tilelru.lnext; tile != &self->tilelru; tile = next) {
+		next = tile->lnext;
+		free(tile);
+	}
+	self->tilelru.lprev = self->tilelru.lnext = &self->tilelru;
+	self->tilemem = 0;
+	free(self->tilehash);
+	self->tilehash = NULL;
+	self->tilehashmask = 0;
+	self->tilemax = 0;
+
+	if (size < self->tilesize)
+		return;
+
+	/* Keep the hash chains at about 2 entries for a full cache */
+	for (n = 16; n < size / self->tilesize / 2; n <<= 1)
+		;
+	self->tilehash = calloc(n, sizeof(struct celltile *));
+	if (self->tilehash == NULL) {
+		warn("calloc");
+		return;
+	}
+	self->tilehashmask = n - 1;
+	self->tilemax = size;
+}
+
 /*
  * Set clip rectangle with left-upper corner and right-bottom corner.
  */
@@ -261,6 +345,28 @@ rop32_setcontext(struct rop_obj *self, void *mem, uint16_t w)
 	self->width = w;
 }
 
+/*
+ * Blend fg over bg with alpha a, per channel (c * a + d * (255 - a)) / 255,
+ * rounded to nearest. The division uses x / 255 == (x + (x >> 8)) >> 8,
+ * which is exact for x + 128 < 65536. The SIMD variants below compute
+ * exactly the same values.
+ */
+static inline uint32_t
+rop32_blend(color fg, color bg, uint32_t a)
+{
+	uint32_t res = 0, c, d, x;
+	int i;
+
+	for (i = 0; i < 24; i += 8) {
+		c = (fg >> i) & 0xff;
+		d = (bg >> i) & 0xff;
+		x = c * a + d * (255 - a) + 128;
+		res |= ((x + (x >> 8)) >> 8) << i;
+	}
+
+	return res;
+}
+
 static void
 rop32_alphaexpand(void *target, int towidth, uint8_t *src, int x, int y,
     int w, int h, int srcpitch, color fg, color bg)
@@ -269,30 +375,157 @@ rop32_alphaexpand(void *target, int towidth, uint8_t *src, int x, int y,
 	uint8_t *mysrc = &src[y * srcpitch + x];
 	int i, j;
 	uint8_t a;
-	uint8_t r, g, b, ar, ag, ab;
 
-	r = (fg & 0x00ff0000) >> 16;
-	g = (fg & 0x0000ff00) >> 8;
-	b = (fg & 0x000000ff) >> 0;
-	ar = (bg & 0x00ff0000) >> 16;
-	ag = (bg & 0x0000ff00) >> 8;
-	ab = (bg & 0x000000ff) >> 0;
-
-#define AASCALE(c,d,f) (((((uint16_t)(c)) * (f)) + (((uint16_t)(d)) * (255 - (f)))) / 255)
 	for (i = 0; i < h; i++) {
 		for (j = 0; j < w; j++) {
 			a = mysrc[i * srcpitch + j];
-			if (a > 0) {
-				p[i * towidth + j] =
-				    (AASCALE(r,ar,a) << 16) |
-				    (AASCALE(g,ag,a) << 8) |
-				    (AASCALE(b,ab,a) << 0);
-			}
+			if (a > 0)
+				p[i * towidth + j] = rop32_blend(fg, bg, a);
+		}
+	}
+}
+
+#ifdef ROP32_X86
+/*
+ * The SIMD variants handle 8 pixels per iteration. They blend with 16 bits
+ * per channel, and keep the target pixels where the alpha value is 0.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+rop32_blend_sse2(__m128i fg, __m128i bg, __m128i a, __m128i c128)
+{
+	__m128i x;
+
+	x = _mm_add_epi16(_mm_mullo_epi16(fg, a),
+	    _mm_mullo_epi16(bg, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+	x = _mm_add_epi16(x, c128);
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void
+rop32_alphaexpand_sse2(void *target, int towidth, uint8_t *src, int x, int y,
+    int w, int h, int srcpitch, color fg, color bg)
+{
+	uint32_t *p = (uint32_t *)target;
+	uint8_t *mysrc = &src[y * srcpitch + x];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c128 = _mm_set1_epi16(128);
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	__m128i vfg, vbg, a8, a16, aa, keep, lo, hi, res, *tp;
+	int i, j;
+	uint8_t a;
+
+	vfg = _mm_unpacklo_epi8(_mm_set1_epi32(fg & 0x00ffffff), zero);
+	vbg = _mm_unpacklo_epi8(_mm_set1_epi32(bg & 0x00ffffff), zero);
+
+	for (i = 0; i < h; i++) {
+		for (j = 0; j + 8 <= w; j += 8) {
+			a8 = _mm_loadl_epi64(
+			    (__m128i *)&mysrc[i * srcpitch + j]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(a8, zero)) ==
+			    0xffff)
+				continue;
+			/* a0 a0 a1 a1 ... a7 a7 */
+			a16 = _mm_unpacklo_epi8(a8, a8);
+			/* Pixels 0..3 */
+			aa = _mm_unpacklo_epi16(a16, a16);
+			keep = _mm_cmpeq_epi32(aa, zero);
+			lo = rop32_blend_sse2(vfg, vbg,
+			    _mm_unpacklo_epi8(aa, zero), c128);
+			hi = rop32_blend_sse2(vfg, vbg,
+			    _mm_unpackhi_epi8(aa, zero), c128);
+			res = _mm_and_si128(_mm_packus_epi16(lo, hi), rgb);
+			tp = (__m128i *)&p[i * towidth + j];
+			_mm_storeu_si128(tp, _mm_or_si128(
+			    _mm_and_si128(keep, _mm_loadu_si128(tp)),
+			    _mm_andnot_si128(keep, res)));
+			/* Pixels 4..7 */
+			aa = _mm_unpackhi_epi16(a16, a16);
+			keep = _mm_cmpeq_epi32(aa, zero);
+			lo = rop32_blend_sse2(vfg, vbg,
+			    _mm_unpacklo_epi8(aa, zero), c128);
+			hi = rop32_blend_sse2(vfg, vbg,
+			    _mm_unpackhi_epi8(aa, zero), c128);
+			res = _mm_and_si128(_mm_packus_epi16(lo, hi), rgb);
+			tp = (__m128i *)&p[i * towidth + j + 4];
+			_mm_storeu_si128(tp, _mm_or_si128(
+			    _mm_and_si128(keep, _mm_loadu_si128(tp)),
+			    _mm_andnot_si128(keep, res)));
+		}
+		for (; j < w; j++) {
+			a = mysrc[i * srcpitch + j];
+			if (a > 0)
+				p[i * towidth + j] = rop32_blend(fg, bg, a);
 		}
 	}
-#undef AASCALE
 }
 
+__attribute__((target("avx2")))
+static inline __m256i
+rop32_blend_avx2(__m256i fg, __m256i bg, __m256i a, __m256i c128)
+{
+	__m256i x;
+
+	x = _mm256_add_epi16(_mm256_mullo_epi16(fg, a),
+	    _mm256_mullo_epi16(bg,
+	    _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+	x = _mm256_add_epi16(x, c128);
+	return _mm256_srli_epi16(
+	    _mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void
+rop32_alphaexpand_avx2(void *target, int towidth, uint8_t *src, int x, int y,
+    int w, int h, int srcpitch, color fg, color bg)
+{
+	uint32_t *p = (uint32_t *)target;
+	uint8_t *mysrc = &src[y * srcpitch + x];
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c128 = _mm256_set1_epi16(128);
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	const __m256i bcast = _mm256_set1_epi32(0x01010101);
+	__m256i vfg, vbg, aa, keep, lo, hi, res, *tp;
+	__m128i a8;
+	int i, j;
+	uint8_t a;
+
+	vfg = _mm256_unpacklo_epi8(_mm256_set1_epi32(fg & 0x00ffffff), zero);
+	vbg = _mm256_unpacklo_epi8(_mm256_set1_epi32(bg & 0x00ffffff), zero);
+
+	for (i = 0; i < h; i++) {
+		for (j = 0; j + 8 <= w; j += 8) {
+			a8 = _mm_loadl_epi64(
+			    (__m128i *)&mysrc[i * srcpitch + j]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(a8,
+			    _mm_setzero_si128())) == 0xffff)
+				continue;
+			/* Replicate each alpha value into all 4 bytes */
+			aa = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(a8),
+			    bcast);
+			keep = _mm256_cmpeq_epi32(aa, zero);
+			/* Pixels 0, 1, 4, 5 and 2, 3, 6, 7 */
+			lo = rop32_blend_avx2(vfg, vbg,
+			    _mm256_unpacklo_epi8(aa, zero), c128);
+			hi = rop32_blend_avx2(vfg, vbg,
+			    _mm256_unpackhi_epi8(aa, zero), c128);
+			res = _mm256_and_si256(_mm256_packus_epi16(lo, hi),
+			    rgb);
+			tp = (__m256i *)&p[i * towidth + j];
+			_mm256_storeu_si256(tp, _mm256_or_si256(
+			    _mm256_and_si256(keep, _mm256_loadu_si256(tp)),
+			    _mm256_andnot_si256(keep, res)));
+		}
+		for (; j < w; j++) {
+			a = mysrc[i * srcpitch + j];
+			if (a > 0)
+				p[i * towidth + j] = rop32_blend(fg, bg, a);
+		}
+	}
+}
+#endif /* ROP32_X86 */
+
 static void
 rop32_blit8_aa(struct rop_obj *self, point pos, uint8_t *src, int w, int h,
     int pitch, color fg, color bg)
@@ -305,7 +538,7 @@ rop32_blit8_aa(struct rop_obj *self, point pos, uint8_t *src, int w, int h,
 	c = MIN(w, self->clip.b.x - pos.x);
 	d = MIN(h, self->clip.b.y - pos.y);
 
-	rop32_alphaexpand(&p[b * self->width + a], self->width, src, a, b,
+	self->alphaexpand(&p[b * self->width + a], self->width, src, a, b,
 	    c - a, d - b, pitch, fg, bg);
 }
 
@@ -507,9 +740,6 @@ rop32_move(struct rop_obj *self, point source, point target, dimension dim)
 	sp = &p[source.y * self->width + source.x];
 	tp = &p[target.y * self->width + target.x];
 
-	printf("actual source of blit: x: %d y: %d\n", source.x, source.y);
-	printf("actual target of blit: x: %d y: %d\n", target.x, target.y);
-	printf("actual size of blit: x: %d y: %d\n", dim.x, dim.y);
 	if (source.y >= target.y) {
 		for (i = 0; i < dim.y; i++)
 			memmove(&tp[i * self->width], &sp[i * self->width],
@@ -586,6 +816,159 @@ justadvance:
 	return (point){pos.x + sbit->xadvance, pos.y};
 }
 
+static inline uint32_t
+rop32_tilehash(const uint32_t *c, unsigned int nc, int flags, color fg,
+    color bg)
+{
+	uint32_t h;
+	unsigned int i;
+
+	h = c[0] * 0x9e3779b1;
+	for (i = 1; i < nc; i++)
+		h = (h ^ c[i]) * 0x9e3779b1;
+	h ^= (fg * 0x85ebca6b) ^ (bg * 0xc2b2ae35) ^ (uint32_t)flags;
+	return h ^ (h >> 16);
+}
+
+/* Draw the characters of a cell, a base character and combining marks */
+static void
+rop32_cellchars(struct rop_obj *self, point pos, color fg, color bg,
+    const uint32_t *c, unsigned int nc, int flags)
+{
+	unsigned int i;
+
+	if (nc == 1 && c[0] == ' ')
+		return;
+	for (i = 0; i < nc; i++)
+		rop32_char(self, pos, fg, bg, c[i], flags);
+}
+
+static void
+rop32_rendertile(struct rop_obj *self, struct celltile *tile)
+{
+	uint32_t *fb = self->fb;
+	uint16_t width = self->width;
+	struct pointrectangle clip = self->clip;
+
+	self->fb = tile->px;
+	self->width = self->fontwidth;
+	self->clip.a = (point){0, 0};
+	self->clip.b = (point){self->fontwidth, self->fontheight};
+	rop32_rect(self, (point){0, 0},
+	    (dimension){self->fontwidth, self->fontheight}, tile->bg);
+	rop32_cellchars(self, (point){0, 0}, tile->fg, tile->bg, tile->c,
+	    tile->nc, tile->flags);
+	self->fb = fb;
+	self->width = width;
+	self->clip = clip;
+}
+
+/*
+ * Find the cached rendering of a cell, or render it, possibly replacing
+ * the least recently used tile. Returns NULL when the cache is disabled.
+ */
+static struct celltile *
+rop32_gettile(struct rop_obj *self, const uint32_t *c, unsigned int nc,
+    int flags, color fg, color bg)
+{
+	struct celltile *tile, **tp;
+	uint32_t h;
+
+	if (self->tilehash == NULL)
+		return NULL;
+
+	h = rop32_tilehash(c, nc, flags, fg, bg) & self->tilehashmask;
+	for (tile = self->tilehash[h]; tile != NULL; tile = tile->hnext) {
+		if (tile->c[0] == c[0] && tile->nc == nc &&
+		    tile->flags == flags && tile->fg == fg && tile->bg == bg &&
+		    (nc == 1 || memcmp(&tile->c[1], &c[1],
+		    (nc - 1) * sizeof(*c)) == 0))
+			break;
+	}
+	if (tile != NULL) {
+		/* Move to the front of the LRU list */
+		tile->lprev->lnext = tile->lnext;
+		tile->lnext->lprev = tile->lprev;
+		goto front;
+	}
+
+	if (self->tilemem + self->tilesize > self->tilemax &&
+	    self->tilelru.lprev != &self->tilelru) {
+		/* Evict the least recently used tile and reuse it */
+		tile = self->tilelru.lprev;
+		tile->lprev->lnext = tile->lnext;
+		tile->lnext->lprev = tile->lprev;
+		tp = &self->tilehash[rop32_tilehash(tile->c, tile->nc,
+		    tile->flags, tile->fg, tile->bg) & self->tilehashmask];
+		while (*tp != tile)
+			tp = &(*tp)->hnext;
+		*tp = tile->hnext;
+	} else {
+		tile = malloc(self->tilesize);
+		if (tile == NULL)
+			return NULL;
+		self->tilemem += self->tilesize;
+	}
+	memcpy(tile->c, c, nc * sizeof(*c));
+	tile->nc = nc;
+	tile->flags = flags;
+	tile->fg = fg;
+	tile->bg = bg;
+	rop32_rendertile(self, tile);
+	tile->hnext = self->tilehash[h];
+	self->tilehash[h] = tile;
+
+front:
+	tile->lprev = &self->tilelru;
+	tile->lnext = self->tilelru.lnext;
+	self->tilelru.lnext->lprev = tile;
+	self->tilelru.lnext = tile;
+
+	return tile;
+}
+
+/*
+ * Draw a whole character cell, i.e. the background and the character
+ * clipped to the cell, given the left upper corner of the cell. Combining
+ * marks follow the character in c, and are drawn on top of it. Cells with
+ * the same characters share a cached tile.
+ */
+void
+rop32_cell(struct rop_obj *self, point pos, color fg, color bg,
+    const uint32_t *c, unsigned int nc, int flags)
+{
+	struct celltile *tile;
+	struct pointrectangle clip = self->clip;
+	uint32_t *p = (uint32_t *)self->fb;
+	int16_t a, b, cy, d;
+	int i;
+
+	a = MAX(pos.x, self->clip.a.x);
+	b = MIN(pos.x + self->fontwidth, self->clip.b.x);
+	cy = MAX(pos.y, self->clip.a.y);
+	d = MIN(pos.y + self->fontheight, self->clip.b.y);
+	if (a >= b || cy >= d)
+		return;
+
+	nc = MIN(nc, ROP32_MAXCHARS);
+	tile = rop32_gettile(self, c, nc, flags, fg, bg);
+	if (tile == NULL) {
+		self->clip.a = (point){a, cy};
+		self->clip.b = (point){b, d};
+		rop32_rect(self, pos,
+		    (dimension){self->fontwidth, self->fontheight}, bg);
+		rop32_cellchars(self, pos, fg, bg, c, nc, flags);
+		self->clip = clip;
+		return;
+	}
+
+	for (i = cy; i < d; i++) {
+		memcpy(&p[i * self->width + a],
+		    &tile->px[(i - pos.y) * self->fontwidth + (a - pos.x)],
+		    (b - a) * sizeof(uint32_t));
+	}
+}
+
 /*
  * Draw a string, given the left upper corner to start drawing.
  */
@@ -0,0 +1,1054 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define FBTEKEN_X86
+#endif
+
+#include "term.h"
+
+/*
+ * The terminal model behind libteken, and the drawing of its cells with
+ * rop32, independent of how the pixels get to the screen.
+ */
+
+void	fbteken_bell(void *thunk);
+void	fbteken_cursor(void *thunk, const teken_pos_t *pos);
+void	fbteken_putchar(void *thunk, const teken_pos_t *pos, teken_char_t ch,
+	    const teken_attr_t *attr);
+void	fbteken_fill(void *thunk, const teken_rect_t *rect, teken_char_t ch,
+	    const teken_attr_t *attr);
+void	fbteken_copy(void *thunk, const teken_rect_t *rect,
+	    const teken_pos_t *pos);
+void	fbteken_param(void *thunk, int param, unsigned int val);
+void	fbteken_respond(void *thunk, const void *arg, size_t sz);
+void	fbteken_putchars(void *thunk, const teken_pos_t *pos,
+	    const teken_char_t *ch, unsigned int n, const teken_attr_t *attr);
+void	fbteken_combine(void *thunk, const teken_pos_t *pos, teken_char_t ch);
+
+teken_funcs_t tek_funcs = {
+	fbteken_bell,
+	fbteken_cursor,
+	fbteken_putchar,
+	fbteken_fill,
+	fbteken_copy,
+	fbteken_param,
+	fbteken_respond,
+	fbteken_putchars,
+	fbteken_combine,
+};
+
+uint32_t colormap[NCOLORIDS] = {
+	[TC_BLACK] = 0x00000000,
+	[TC_RED] = 0x00800000,
+	[TC_GREEN] = 0x00008000,
+	[TC_BROWN] = 0x00808000,
+	[TC_BLUE] = 0x000000c0,
+	[TC_MAGENTA] = 0x00800080,
+	[TC_CYAN] = 0x00008080,
+	[TC_WHITE] = 0x00c0c0c0,
+	[TC_BLACK + TC_NCOLORS] = 0x00808080,
+	[TC_RED + TC_NCOLORS] = 0x00ff0000,
+	[TC_GREEN + TC_NCOLORS] = 0x0000ff00,
+	[TC_BROWN + TC_NCOLORS] = 0x00ffff00,
+	[TC_BLUE + TC_NCOLORS] = 0x000000ff,
+	[TC_MAGENTA + TC_NCOLORS] = 0x00ff00ff,
+	[TC_CYAN + TC_NCOLORS] = 0x0000ffff,
+	[TC_WHITE + TC_NCOLORS] = 0x00ffffff,
+};
+
+/*
+ * 24-bit colors are looked up in an open addressing hash table of their
+ * ids, the color itself is in colormap. Workers parse terminals too, so
+ * the table is locked, with the last color cached per thread. Once all ids
+ * are taken, the closest color of the 6x6x6 cube is used instead.
+ */
+#define RGBHASHSIZE	(2 * NCOLORIDS)
+#define CUBE(v)		(((v) * 5 + 127) / 255)
+static uint16_t rgbhash[RGBHASHSIZE];
+static uint32_t nextrgbid = NPALETTE;
+static pthread_mutex_t rgblock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local teken_color_t lastrgb;
+static _Thread_local uint32_t lastrgbid;
+
+uint32_t
+rgb_color_id(teken_color_t c)
+{
+	uint32_t rgb = c & 0xffffff, h, id;
+
+	if (c == lastrgb)
+		return lastrgbid;
+
+	pthread_mutex_lock(&rgblock);
+	h = (rgb * 2654435761U) >> 15;
+	for (;;) {
+		id = rgbhash[h];
+		if (id == 0) {
+			if (nextrgbid == NCOLORIDS) {
+				id = 16 + 36 * CUBE(rgb >> 16) +
+				    6 * CUBE((rgb >> 8) & 0xff) +
+				    CUBE(rgb & 0xff);
+				break;
+			}
+			id = nextrgbid++;
+			colormap[id] = rgb;
+			rgbhash[h] = id;
+			break;
+		}
+		if (colormap[id] == rgb)
+			break;
+		h = (h + 1) % RGBHASHSIZE;
+	}
+	pthread_mutex_unlock(&rgblock);
+
+	lastrgb = c;
+	lastrgbid = id;
+	return id;
+}
+
+/* The xterm 256 color palette, a 6x6x6 color cube and a gray ramp */
+static void
+palette_init(void)
+{
+	static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+	unsigned int i, v;
+
+	for (i = 0; i < 216; i++) {
+		colormap[16 + i] = levels[i / 36] << 16 |
+		    levels[(i / 6) % 6] << 8 | levels[i % 6];
+	}
+	for (i = 0; i < 24; i++) {
+		v = 8 + 10 * i;
+		colormap[232 + i] = v << 16 | v << 8 | v;
+	}
+}
+
+struct rop_obj *rop;
+int fnwidth, fnheight;
+
+#define RENDERMINCELLS	2048
+struct renderer renderers[MAXRENDERERS];
+unsigned int nrenderers = 0;
+pthread_mutex_t renderlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rendercv = PTHREAD_COND_INITIALIZER;
+pthread_cond_t renderdonecv = PTHREAD_COND_INITIALIZER;
+unsigned int rendergen = 0, renderpending = 0;
+bool renderquit = false;
+struct terminal *renderterm;
+unsigned int *renderrows;
+
+struct cellbuf oldbuf;
+teken_pos_t drawncursor;
+bool cursordrawn = false;
+struct rowdamage *termdamage, *scratchdamage;
+uint64_t *damagedrows;
+bool damaged = false;
+struct rowdamage *framedamage;
+bool modelonly = false;
+
+teken_attr_t defattr = {
+	ta_format : 0,
+	ta_fgcolor : TC_WHITE,
+	ta_bgcolor : TC_BLACK,
+};
+teken_attr_t white_defattr = {
+	ta_format : 0,
+	ta_fgcolor : TC_BLACK,
+	ta_bgcolor : TC_WHITE,
+};
+
+/*
+ * Copy operations are applied to the framebuffer by moving the pixels, instead
+ * of redrawing all the moved cells. The moves are queued here and replayed
+ * at the start of redraw_term().
+ */
+#define MAXMOVES	16
+struct cellmove {
+	teken_rect_t rect;
+	teken_pos_t pos;
+};
+struct cellmove pendmoves[MAXMOVES];
+unsigned int npendmoves = 0;
+
+int
+cellbuf_init(struct cellbuf *cb, unsigned int cols, unsigned int nrows)
+{
+	unsigned int i;
+
+	cb->cells = calloc(cols * nrows, sizeof(*cb->cells));
+	cb->rows = calloc(nrows, sizeof(*cb->rows));
+	if (cb->cells == NULL || cb->rows == NULL) {
+		free(cb->cells);
+		free(cb->rows);
+		return 1;
+	}
+	for (i = 0; i < nrows; i++)
+		cb->rows[i] = &cb->cells[i * cols];
+	cb->head = 0;
+	cb->cols = cols;
+	cb->nrows = nrows;
+
+	return 0;
+}
+
+void
+cellbuf_free(struct cellbuf *cb)
+{
+	free(cb->rows);
+	free(cb->cells);
+	cb->rows = NULL;
+	cb->cells = NULL;
+}
+
+/* Reverse the order of the screen rows [a, b). */
+static void
+cellbuf_reverse(struct cellbuf *cb, unsigned int a, unsigned int b)
+{
+	cell_t **p, **q, *tmp;
+
+	while (a + 1 < b) {
+		p = cellbuf_slot(cb, a++);
+		q = cellbuf_slot(cb, --b);
+		tmp = *p;
+		*p = *q;
+		*q = tmp;
+	}
+}
+
+/*
+ * Rotate the screen rows [begin, end) downwards by amount rows (upwards
+ * for a negative amount). Rows which are pushed out at one end of the
+ * region reappear at the other end.
+ */
+static void
+cellbuf_rotate(struct cellbuf *cb, unsigned int begin, unsigned int end,
+    int amount)
+{
+	unsigned int n, r;
+
+	n = end - begin;
+	r = ((amount % (int)n) + n) % n;
+	if (r == 0)
+		return;
+
+	if (begin == 0 && end == cb->nrows) {
+		/* The whole screen is scrolled, just move the ring head. */
+		cb->head = (cb->head + cb->nrows - r) % cb->nrows;
+		return;
+	}
+
+	cellbuf_reverse(cb, begin, end);
+	cellbuf_reverse(cb, begin, begin + r);
+	cellbuf_reverse(cb, begin + r, end);
+}
+
+/*
+ * Implementation of the tf_copy operation on a cell buffer.
+ *
+ * Copies of whole rows are done by rotating the rows of the affected region,
+ * so the rows which are uncovered by the copy end up with the contents of
+ * the overwritten rows. libteken always fills the uncovered area right after
+ * such a copy, so this is never visible.
+ */
+static void
+cellbuf_copy(struct cellbuf *cb, const teken_rect_t *rect,
+    const teken_pos_t *pos)
+{
+	teken_unit_t w, h;
+	teken_unit_t scol, srow, tcol, trow;
+	int a;
+
+	scol = rect->tr_begin.tp_col;
+	srow = rect->tr_begin.tp_row;
+	tcol = pos->tp_col;
+	trow = pos->tp_row;
+	w = rect->tr_end.tp_col - rect->tr_begin.tp_col;
+	h = rect->tr_end.tp_row - rect->tr_begin.tp_row;
+
+	if (scol == 0 && tcol == 0 && w == cb->cols) {
+		if (srow < trow)
+			cellbuf_rotate(cb, srow, trow + h, trow - srow);
+		else if (srow > trow)
+			cellbuf_rotate(cb, trow, srow + h, trow - srow);
+		return;
+	}
+
+	if (srow < trow) {
+		for (a = h - 1; a >= 0; a--) {
+			memmove(&cellbuf_row(cb, trow + a)[tcol],
+			    &cellbuf_row(cb, srow + a)[scol],
+			    w * sizeof(cell_t));
+		}
+	} else {
+		for (a = 0; a < h; a++) {
+			memmove(&cellbuf_row(cb, trow + a)[tcol],
+			    &cellbuf_row(cb, srow + a)[scol],
+			    w * sizeof(cell_t));
+		}
+	}
+}
+
+/*
+ * Overwrite the rows [begin, end) with a character which never matches any
+ * real cell contents, so that these rows get completely redrawn.
+ */
+static void
+cellbuf_invalidate(struct cellbuf *cb, unsigned int begin, unsigned int end)
+{
+	cell_t *cells;
+	unsigned int i, j;
+
+	for (i = begin; i < end; i++) {
+		cells = cellbuf_row(cb, i);
+		for (j = 0; j < cb->cols; j++)
+			cells[j] = CELL_INVALID;
+	}
+}
+
+/* Make sure that the cell gets redrawn */
+static void
+invalidate_cell(uint16_t col, uint16_t row)
+{
+	cellbuf_row(&oldbuf, row)[col] = CELL_INVALID;
+	mark_damage(row, col, col + 1);
+}
+
+/* Whether the cursor needs to be redrawn */
+bool
+cursor_moved(struct terminal *t)
+{
+	if (!cursor_visible(t))
+		return cursordrawn;
+	return !cursordrawn ||
+	    drawncursor.tp_col != t->cursorpos.tp_col ||
+	    drawncursor.tp_row != t->cursorpos.tp_row;
+}
+
+/*
+ * Move the damage along with the cells of a copy. The rows uncovered by a
+ * full-width copy were invalidated in oldbuf, so they are completely damaged.
+ */
+static void
+move_damage(const teken_rect_t *rect, const teken_pos_t *pos,
+    unsigned int cols)
+{
+	struct rowdamage *d;
+	unsigned int i, h, w, srow, trow, scol, tcol;
+	bool full;
+
+	srow = rect->tr_begin.tp_row;
+	scol = rect->tr_begin.tp_col;
+	trow = pos->tp_row;
+	tcol = pos->tp_col;
+	h = rect->tr_end.tp_row - srow;
+	w = rect->tr_end.tp_col - scol;
+	full = scol == 0 && tcol == 0 && w == cols;
+
+	for (i = 0; i < h; i++) {
+		d = &termdamage[srow + i];
+		scratchdamage[i].x0 = MAX(d->x0, scol) - scol + tcol;
+		scratchdamage[i].x1 = MIN(d->x1, scol + w) - scol + tcol;
+		if (d->x0 >= d->x1 || d->x0 >= scol + w || d->x1 <= scol)
+			scratchdamage[i].x0 = scratchdamage[i].x1 = 0;
+	}
+	if (full) {
+		for (i = 0; i < h; i++) {
+			termdamage[trow + i] = scratchdamage[i];
+			if (scratchdamage[i].x0 < scratchdamage[i].x1) {
+				damagedrows[(trow + i) / 64] |=
+				    (uint64_t)1 << ((trow + i) % 64);
+			}
+		}
+		if (srow < trow) {
+			for (i = srow; i < trow; i++)
+				mark_damage(i, 0, cols);
+		} else {
+			for (i = trow + h; i < srow + h; i++)
+				mark_damage(i, 0, cols);
+		}
+	} else {
+		for (i = 0; i < h; i++) {
+			if (scratchdamage[i].x0 < scratchdamage[i].x1) {
+				mark_damage(trow + i, scratchdamage[i].x0,
+				    scratchdamage[i].x1);
+			}
+		}
+	}
+}
+
+static void
+render_cell(struct rop_obj *r, struct terminal *t, uint16_t col, uint16_t row)
+{
+	cell_t cell;
+	teken_format_t format;
+	uint32_t ch[GRAPHEME_MAXLEN];
+	unsigned int nch;
+	uint16_t sx, sy;
+	uint32_t bg, fg, val;
+	int cursor, flags = 0;
+
+	cell = cellbuf_row(term_screen(t), row)[col];
+	format = CELL_FORMAT(cell);
+	cursor = cursor_visible(t) && col == t->cursorpos.tp_col &&
+	    row == t->cursorpos.tp_row;
+	nch = grapheme_get(CELL_CH(cell), ch);
+
+	sx = col * fnwidth;
+	sy = row * fnheight;
+	if (format & TF_REVERSE) {
+		fg = CELL_BG(cell);
+		bg = CELL_FG(cell);
+	} else {
+		fg = CELL_FG(cell);
+		bg = CELL_BG(cell);
+	}
+	/* Bold makes the 8 basic colors bright */
+	if ((format & TF_BOLD) && fg < TC_NCOLORS)
+		fg += TC_NCOLORS;
+	fg = colormap[fg];
+	bg = colormap[bg];
+	if (cursor) {
+		val = fg;
+		fg = bg;
+		bg = val;
+	}
+	if (format & TF_UNDERLINE)
+		flags |= 1;
+	if (format & TF_BOLD)
+		flags |= 2;
+	rop32_cell(r, (point){sx, sy}, fg, bg, ch, nch, flags);
+	add_damage(&framedamage[row], col, col + 1);
+}
+
+static void
+set_cell(struct terminal *t, uint16_t col, uint16_t row, teken_char_t ch,
+    const teken_attr_t *attr)
+{
+	cell_t *cell, val;
+
+	cell = term_cell(t, col, row);
+	val = make_cell(ch, attr);
+	if (*cell == val)
+		return;
+	*cell = val;
+	if (term_tracked(t))
+		mark_damage(row, col, col + 1);
+}
+
+/*
+ * Store n cells starting at the given position, and record the range which
+ * actually changed as damage.
+ */
+static void
+set_cells(struct terminal *t, uint16_t col, uint16_t row,
+    const teken_char_t *ch, int chstep, unsigned int n,
+    const teken_attr_t *attr)
+{
+	cell_t *cells, a, val;
+	unsigned int i, lo = n, hi = 0;
+
+	cells = &cellbuf_row(&t->buf, row)[col];
+	a = make_cell(0, attr);
+	for (i = 0; i < n; i++, ch += chstep) {
+		val = a | *ch;
+		if (cells[i] != val) {
+			cells[i] = val;
+			if (lo == n)
+				lo = i;
+			hi = i + 1;
+		}
+	}
+	if (lo < hi && term_tracked(t))
+		mark_damage(row, col + lo, col + hi);
+}
+
+void
+fbteken_bell(void *thunk __unused)
+{
+	/* XXX */
+}
+
+void
+fbteken_cursor(void *thunk, const teken_pos_t *pos)
+{
+	struct terminal *t = (struct terminal *)thunk;
+
+	if (t->cursorpos.tp_col == pos->tp_col &&
+	    t->cursorpos.tp_row == pos->tp_row)
+		return;
+	t->cursorpos = *pos;
+}
+
+void
+fbteken_putchar(void *thunk, const teken_pos_t *pos, teken_char_t ch,
+    const teken_attr_t *attr)
+{
+	struct terminal *t = (struct terminal *)thunk;
+
+	set_cell(t, pos->tp_col, pos->tp_row, ch, attr);
+}
+
+void
+fbteken_putchars(void *thunk, const teken_pos_t *pos, const teken_char_t *ch,
+    unsigned int n, const teken_attr_t *attr)
+{
+	struct terminal *t = (struct terminal *)thunk;
+
+	set_cells(t, pos->tp_col, pos->tp_row, ch, 1, n, attr);
+}
+
+/*
+ * Add a combining character to a cell, or to both cells of a wide
+ * character. The cell then holds the id of the grapheme cluster.
+ */
+void
+fbteken_combine(void *thunk, const teken_pos_t *pos, teken_char_t ch)
+{
+	struct terminal *t = (struct terminal *)thunk;
+	cell_t *cells, base;
+	uint16_t col = pos->tp_col, n = 1;
+	uint32_t id;
+
+	cells = cellbuf_row(&t->buf, pos->tp_row);
+	if ((CELL_FORMAT(cells[col]) & TF_CJK_RIGHT) && col > 0 &&
+	    CELL_CH(cells[col - 1]) == CELL_CH(cells[col]))
+		col--;
+	base = cells[col];
+	if (col + 1 < t->buf.cols &&
+	    (CELL_FORMAT(cells[col + 1]) & TF_CJK_RIGHT) &&
+	    CELL_CH(cells[col + 1]) == CELL_CH(base))
+		n = 2;
+	id = grapheme_append(CELL_CH(base), ch);
+	if (id == CELL_CH(base))
+		return;
+	cells[col] = (cells[col] & ~CELL_CHMASK) | id;
+	if (n == 2)
+		cells[col + 1] = (cells[col + 1] & ~CELL_CHMASK) | id;
+	if (term_tracked(t))
+		mark_damage(pos->tp_row, col, col + n);
+}
+
+void
+fbteken_fill(void *thunk, const teken_rect_t *rect, teken_char_t ch,
+    const teken_attr_t *attr)
+{
+	struct terminal *t = (struct terminal *)thunk;
+	teken_unit_t a;
+
+	for (a = rect->tr_begin.tp_row; a < rect->tr_end.tp_row; a++) {
+		set_cells(t, rect->tr_begin.tp_col, a, &ch, 0,
+		    rect->tr_end.tp_col - rect->tr_begin.tp_col, attr);
+	}
+}
+
+/*
+ * Queue a framebuffer move, or merge it with the previous one when both move
+ * the same region in the same direction (i.e. for repeated scrolling).
+ * Returns non-zero when the queue is full.
+ */
+static int
+queue_move(const teken_rect_t *rect, const teken_pos_t *pos)
+{
+	struct cellmove *m;
+	int d, dm;
+	unsigned int lo, hi;
+
+	d = pos->tp_row - rect->tr_begin.tp_row;
+	lo = MIN(rect->tr_begin.tp_row, pos->tp_row);
+	hi = MAX(rect->tr_end.tp_row, pos->tp_row +
+	    (rect->tr_end.tp_row - rect->tr_begin.tp_row));
+
+	if (npendmoves > 0 && d != 0 &&
+	    pos->tp_col == rect->tr_begin.tp_col) {
+		m = &pendmoves[npendmoves - 1];
+		dm = m->pos.tp_row - m->rect.tr_begin.tp_row;
+		if (m->pos.tp_col == m->rect.tr_begin.tp_col &&
+		    m->rect.tr_begin.tp_col == rect->tr_begin.tp_col &&
+		    m->rect.tr_end.tp_col == rect->tr_end.tp_col &&
+		    MIN(m->rect.tr_begin.tp_row, m->pos.tp_row) == lo &&
+		    MAX(m->rect.tr_end.tp_row, m->pos.tp_row +
+		    (m->rect.tr_end.tp_row - m->rect.tr_begin.tp_row)) == hi &&
+		    (dm < 0) == (d < 0)) {
+			d += dm;
+			if ((unsigned int)abs(d) >= hi - lo) {
+				/* Everything moved out of the region. */
+				npendmoves--;
+			} else if (d < 0) {
+				m->rect.tr_begin.tp_row = lo - d;
+				m->rect.tr_end.tp_row = hi;
+				m->pos.tp_row = lo;
+			} else {
+				m->rect.tr_begin.tp_row = lo;
+				m->rect.tr_end.tp_row = hi - d;
+				m->pos.tp_row = lo + d;
+			}
+			return 0;
+		}
+	}
+
+	if (npendmoves == MAXMOVES)
+		return 1;
+	pendmoves[npendmoves].rect = *rect;
+	pendmoves[npendmoves].pos = *pos;
+	npendmoves++;
+
+	return 0;
+}
+
+/*
+ * The cursor image moves with the pixels, but may also remain in the source
+ * cell. If the image got overwritten, no cell shows it anymore.
+ */
+static void
+move_drawncursor(const teken_rect_t *rect, const teken_pos_t *pos)
+{
+	teken_pos_t *c = &drawncursor;
+
+	if (!cursordrawn)
+		return;
+	if (c->tp_col >= rect->tr_begin.tp_col &&
+	    c->tp_col < rect->tr_end.tp_col &&
+	    c->tp_row >= rect->tr_begin.tp_row &&
+	    c->tp_row < rect->tr_end.tp_row) {
+		invalidate_cell(c->tp_col, c->tp_row);
+		c->tp_col += pos->tp_col - rect->tr_begin.tp_col;
+		c->tp_row += pos->tp_row - rect->tr_begin.tp_row;
+	} else if (c->tp_col >= pos->tp_col && c->tp_col < pos->tp_col +
+	    (rect->tr_end.tp_col - rect->tr_begin.tp_col) &&
+	    c->tp_row >= pos->tp_row && c->tp_row < pos->tp_row +
+	    (rect->tr_end.tp_row - rect->tr_begin.tp_row)) {
+		cursordrawn = false;
+	} else if (cellbuf_row(&oldbuf, c->tp_row)[c->tp_col] ==
+	    CELL_INVALID) {
+		/* The cell was uncovered and is going to be redrawn */
+		cursordrawn = false;
+	}
+}
+
+void
+fbteken_copy(void *thunk, const teken_rect_t *rect, const teken_pos_t *pos)
+{
+	struct terminal *t = (struct terminal *)thunk;
+	teken_unit_t srow, trow, h;
+	unsigned int i;
+
+	/* Rows scrolled off the top of the screen go into the history */
+	if (t->hist != NULL && pos->tp_row == 0 && rect->tr_begin.tp_row > 0 &&
+	    rect->tr_begin.tp_col == 0 && pos->tp_col == 0 &&
+	    rect->tr_end.tp_col == t->buf.cols) {
+		for (i = 0; i < rect->tr_begin.tp_row; i++)
+			history_push(t->hist, cellbuf_row(&t->buf, i));
+	}
+
+	cellbuf_copy(&t->buf, rect, pos);
+	if (!term_tracked(t))
+		return;
+
+	if (queue_move(rect, pos) != 0) {
+		/* Too many moves queued, just redraw everything. */
+		npendmoves = 0;
+		cellbuf_invalidate(&oldbuf, 0, oldbuf.nrows);
+		for (i = 0; i < oldbuf.nrows; i++)
+			mark_damage(i, 0, oldbuf.cols);
+		cursordrawn = false;
+	} else {
+		cellbuf_copy(&oldbuf, rect, pos);
+		/*
+		 * The pixels of the uncovered rows aren't touched by the
+		 * move, but cellbuf_copy() rotated other rows in there.
+		 */
+		srow = rect->tr_begin.tp_row;
+		trow = pos->tp_row;
+		h = rect->tr_end.tp_row - rect->tr_begin.tp_row;
+		if (rect->tr_begin.tp_col == 0 && pos->tp_col == 0 &&
+		    rect->tr_end.tp_col == oldbuf.cols) {
+			if (srow < trow)
+				cellbuf_invalidate(&oldbuf, srow, trow);
+			else if (srow > trow)
+				cellbuf_invalidate(&oldbuf, trow + h,
+				    srow + h);
+		}
+		move_damage(rect, pos, oldbuf.cols);
+		move_drawncursor(rect, pos);
+		/* Make sure that the move gets replayed */
+		damaged = true;
+	}
+}
+
+void
+fbteken_param(void *thunk, int param, unsigned int val)
+{
+	struct terminal *t = (struct terminal *)thunk;
+
+//	fprintf(stderr, "fbteken_param param=%d val=%u\n", param, val);
+	switch (param) {
+	case 0:
+		if (val)
+			t->showcursor = 1;
+		else
+			t->showcursor = 0;
+		break;
+	case 1:
+		if (val)
+			t->keypad = 1;
+		else
+			t->keypad = 0;
+		break;
+	case 6:
+		/* XXX */
+		break;
+	default:
+		break;
+	}
+}
+
+void
+fbteken_respond(void *thunk __unused, const void *arg __unused,
+    size_t sz __unused)
+{
+	/* XXX */
+}
+
+/*
+ * Return the index of the first of the n cells which differs between a and
+ * b, or n if they are all equal.
+ */
+static unsigned int
+cells_diff_scalar(const cell_t *a, const cell_t *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+	return i;
+}
+
+#ifdef FBTEKEN_X86
+__attribute__((target("sse2")))
+static unsigned int
+cells_diff_sse2(const cell_t *a, const cell_t *b, unsigned int n)
+{
+	__m128i x, y;
+	unsigned int i;
+	int m;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&a[i]),
+		    _mm_loadu_si128((const __m128i *)&b[i]));
+		y = _mm_cmpeq_epi32(
+		    _mm_loadu_si128((const __m128i *)&a[i + 2]),
+		    _mm_loadu_si128((const __m128i *)&b[i + 2]));
+		m = _mm_movemask_epi8(_mm_and_si128(x, y));
+		if (m != 0xffff)
+			break;
+	}
+	return i + cells_diff_scalar(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+cells_diff_avx2(const cell_t *a, const cell_t *b, unsigned int n)
+{
+	__m256i x, y;
+	unsigned int i;
+	int m;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm256_cmpeq_epi64(
+		    _mm256_loadu_si256((const __m256i *)&a[i]),
+		    _mm256_loadu_si256((const __m256i *)&b[i]));
+		y = _mm256_cmpeq_epi64(
+		    _mm256_loadu_si256((const __m256i *)&a[i + 4]),
+		    _mm256_loadu_si256((const __m256i *)&b[i + 4]));
+		m = _mm256_movemask_epi8(_mm256_and_si256(x, y));
+		if (m != -1)
+			break;
+	}
+	return i + cells_diff_sse2(&a[i], &b[i], n - i);
+}
+#endif
+
+static unsigned int (*cells_diff)(const cell_t *, const cell_t *,
+    unsigned int) = cells_diff_scalar;
+
+static void
+replay_moves(void)
+{
+	struct cellmove *m;
+	unsigned int i, j;
+
+	for (i = 0; i < npendmoves; i++) {
+		m = &pendmoves[i];
+		for (j = 0; j < (unsigned)(m->rect.tr_end.tp_row -
+		    m->rect.tr_begin.tp_row); j++) {
+			add_damage(&framedamage[m->pos.tp_row + j],
+			    m->pos.tp_col, m->pos.tp_col +
+			    (m->rect.tr_end.tp_col - m->rect.tr_begin.tp_col));
+		}
+		rop32_move(rop,
+		    (point){m->rect.tr_begin.tp_col * fnwidth,
+		    m->rect.tr_begin.tp_row * fnheight},
+		    (point){m->pos.tp_col * fnwidth,
+		    m->pos.tp_row * fnheight},
+		    (dimension){
+		    (m->rect.tr_end.tp_col - m->rect.tr_begin.tp_col) * fnwidth,
+		    (m->rect.tr_end.tp_row - m->rect.tr_begin.tp_row) * fnheight});
+	}
+	npendmoves = 0;
+}
+
+/* Draw the cells of row i which differ from oldbuf, and count them */
+static unsigned int
+redraw_row(struct rop_obj *r, struct terminal *t, unsigned int i)
+{
+	struct rowdamage *d = &termdamage[i];
+	cell_t *cells, *ocells;
+	unsigned int j, n = 0;
+
+	cells = cellbuf_row(term_screen(t), i);
+	ocells = cellbuf_row(&oldbuf, i);
+	j = d->x0;
+	for (;;) {
+		j += cells_diff(&cells[j], &ocells[j], d->x1 - j);
+		if (j >= d->x1)
+			break;
+		render_cell(r, t, j, i);
+		ocells[j] = cells[j];
+		j++;
+		n++;
+	}
+	d->x0 = d->x1 = 0;
+
+	return n;
+}
+
+static void *
+renderer_main(void *arg)
+{
+	struct renderer *r = (struct renderer *)arg;
+	unsigned int gen = 0, k;
+
+	pthread_mutex_lock(&renderlock);
+	for (;;) {
+		while (gen == rendergen && !renderquit)
+			pthread_cond_wait(&rendercv, &renderlock);
+		if (renderquit)
+			break;
+		gen = rendergen;
+		pthread_mutex_unlock(&renderlock);
+
+		r->drawn = 0;
+		for (k = r->first; k < r->last; k++)
+			r->drawn += redraw_row(r->rop, renderterm, renderrows[k]);
+
+		pthread_mutex_lock(&renderlock);
+		if (--renderpending == 0)
+			pthread_cond_signal(&renderdonecv);
+	}
+	pthread_mutex_unlock(&renderlock);
+
+	return NULL;
+}
+
+/*
+ * Draw the n rows in renderrows, split into bands of about the same size,
+ * and return the number of cells drawn. The main thread takes the first
+ * band.
+ */
+static unsigned int
+render_bands(struct terminal *t, unsigned int n)
+{
+	unsigned int i, k, drawn = 0;
+
+	pthread_mutex_lock(&renderlock);
+	renderterm = t;
+	for (i = 0; i < nrenderers; i++) {
+		renderers[i].first = n * (i + 1) / (nrenderers + 1);
+		renderers[i].last = n * (i + 2) / (nrenderers + 1);
+	}
+	renderpending = nrenderers;
+	rendergen++;
+	pthread_cond_broadcast(&rendercv);
+	pthread_mutex_unlock(&renderlock);
+
+	for (k = 0; k < n / (nrenderers + 1); k++)
+		drawn += redraw_row(rop, t, renderrows[k]);
+
+	pthread_mutex_lock(&renderlock);
+	while (renderpending > 0)
+		pthread_cond_wait(&renderdonecv, &renderlock);
+	for (i = 0; i < nrenderers; i++)
+		drawn += renderers[i].drawn;
+	pthread_mutex_unlock(&renderlock);
+
+	return drawn;
+}
+
+/* Set the drawing target for all the rop_objs */
+void
+set_drawcontext(void *mem, uint16_t w)
+{
+	unsigned int i;
+
+	rop32_setcontext(rop, mem, w);
+	for (i = 0; i < nrenderers; i++)
+		rop32_setcontext(renderers[i].rop, mem, w);
+}
+
+void
+renderers_start(void)
+{
+	sigset_t set, oset;
+	unsigned int i;
+
+	/* Signals are handled by the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (i = 0; i < nrenderers; i++) {
+		errno = pthread_create(&renderers[i].thread, NULL,
+		    renderer_main, &renderers[i]);
+		if (errno != 0)
+			err(1, "pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+void
+renderers_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&renderlock);
+	renderquit = true;
+	pthread_cond_broadcast(&rendercv);
+	pthread_mutex_unlock(&renderlock);
+	for (i = 0; i < nrenderers; i++)
+		pthread_join(renderers[i].thread, NULL);
+}
+
+/* Draw the cells of t which changed, and return their number */
+unsigned int
+redraw_term(struct terminal *t)
+{
+	unsigned int i, n, w, ncells, drawn = 0;
+	uint64_t bits;
+
+	replay_moves();
+	if (cursor_moved(t)) {
+		if (cursordrawn)
+			invalidate_cell(drawncursor.tp_col,
+			    drawncursor.tp_row);
+		if (cursor_visible(t))
+			invalidate_cell(t->cursorpos.tp_col,
+			    t->cursorpos.tp_row);
+		cursordrawn = cursor_visible(t);
+		drawncursor = t->cursorpos;
+	}
+	n = ncells = 0;
+	for (w = 0; w < (t->winsz.ws_row + 63u) / 64; w++) {
+		bits = damagedrows[w];
+		damagedrows[w] = 0;
+		while (bits != 0) {
+			i = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			renderrows[n++] = i;
+			ncells += termdamage[i].x1 - termdamage[i].x0;
+		}
+	}
+	/* Waking up the renderers only pays off for large redraws */
+	if (nrenderers > 0 && ncells >= RENDERMINCELLS) {
+		drawn = render_bands(t, n);
+	} else {
+		for (i = 0; i < n; i++)
+			drawn += redraw_row(rop, t, renderrows[i]);
+	}
+	damaged = false;
+
+	return drawn;
+}
+
+/*
+ * Allocate the drawing state for a screen of cols x rows cells, which
+ * initially shows blanks with the given attributes.
+ */
+int
+redraw_init(unsigned int cols, unsigned int rows, const teken_attr_t *attr)
+{
+	unsigned int i;
+
+	palette_init();
+	if (cellbuf_init(&oldbuf, cols, rows) != 0)
+		return 1;
+	for (i = 0; i < cols * rows; i++)
+		oldbuf.cells[i] = make_cell(' ', attr);
+	termdamage = calloc(rows, sizeof(struct rowdamage));
+	scratchdamage = calloc(rows, sizeof(struct rowdamage));
+	damagedrows = calloc((rows + 63) / 64, sizeof(uint64_t));
+	renderrows = calloc(rows, sizeof(unsigned int));
+	framedamage = calloc(rows, sizeof(struct rowdamage));
+	if (termdamage == NULL || scratchdamage == NULL ||
+	    damagedrows == NULL || renderrows == NULL || framedamage == NULL) {
+		redraw_free();
+		return 1;
+	}
+
+#ifdef FBTEKEN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		cells_diff = cells_diff_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		cells_diff = cells_diff_sse2;
+#endif
+
+	return 0;
+}
+
+void
+redraw_free(void)
+{
+	cellbuf_free(&oldbuf);
+	free(termdamage);
+	free(scratchdamage);
+	free(damagedrows);
+	free(renderrows);
+	free(framedamage);
+	termdamage = scratchdamage = framedamage = NULL;
+	damagedrows = NULL;
+	renderrows = NULL;
+}
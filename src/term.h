@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2015  Imre Vadasz.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TERM_H_
+#define _TERM_H_	0
+
+#include <sys/param.h>
+#include <sys/ioctl.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fbdraw.h"
+#include "grapheme.h"
+#include "history.h"
+#include "../libteken/teken.h"
+
+/*
+ * A character cell, packed into 64 bits so that cells can be compared as
+ * whole words. The cursor is kept out of band.
+ *   bits  0..21  character, or grapheme cluster id with GRAPHEME_FLAG
+ *   bits 24..28  teken_format_t
+ *   bits 32..47  foreground color id
+ *   bits 48..63  background color id
+ */
+typedef uint64_t cell_t;
+
+#define CELL_CHMASK	((cell_t)GRAPHEME_FLAG | (GRAPHEME_FLAG - 1))
+#define CELL_CH(c)	((uint32_t)((c) & CELL_CHMASK))
+#define CELL_FORMAT(c)	((teken_format_t)(((c) >> 24) & 0x1f))
+#define CELL_FG(c)	((uint32_t)(((c) >> 32) & 0xffff))
+#define CELL_BG(c)	((uint32_t)((c) >> 48))
+
+/* Value which never matches any real cell */
+#define CELL_INVALID	(~(cell_t)0)
+
+/*
+ * Character cells of a terminal screen. The rows are accessed indirectly
+ * through a ring of row pointers, so that scrolling only needs to rotate
+ * the row table (or just the head offset, when the whole screen scrolls)
+ * instead of moving the cell contents around.
+ */
+struct cellbuf {
+	cell_t *cells;			/* storage for nrows * cols cells */
+	cell_t **rows;			/* ring of pointers into cells */
+	unsigned int head;		/* ring index of the first screen row */
+	unsigned int cols, nrows;
+};
+
+/* A column range [x0, x1) of changed cells in a row */
+struct rowdamage {
+	uint16_t x0, x1;
+};
+
+struct terminal {
+	teken_t tek;
+	struct cellbuf buf;
+	struct history *hist;
+	struct cellbuf view;		/* shown while scrolled back */
+	unsigned int histoff;		/* rows scrolled back */
+	teken_pos_t cursorpos;
+	int keypad, showcursor;
+	struct winsize winsz;
+	int amaster;
+	pid_t child;
+	struct event *masterev;
+	bool started;
+	bool shown;			/* drawn on the screen */
+	bool dead;			/* pty failed while in a worker */
+
+	/* Not reset by term_start() */
+	pthread_mutex_t lock;		/* held while parsing */
+	atomic_bool inworker;		/* parsed by a worker thread */
+};
+
+extern teken_funcs_t tek_funcs;
+
+/*
+ * Cells hold 16-bit color ids, which index colormap. The ids below NPALETTE
+ * are the xterm colors, 24-bit colors get the following ids when they are
+ * first used.
+ */
+#define NPALETTE	256
+#define NCOLORIDS	65536
+extern uint32_t colormap[NCOLORIDS];
+uint32_t rgb_color_id(teken_color_t);
+extern teken_attr_t defattr, white_defattr;
+
+extern struct rop_obj *rop;
+extern int fnwidth, fnheight;
+
+/*
+ * With -t, large redraws are split into bands of rows, which are drawn in
+ * parallel by the main thread and the renderers.
+ */
+#define MAXRENDERERS	15
+struct renderer {
+	pthread_t thread;
+	struct rop_obj *rop;		/* own glyph and cell caches */
+	unsigned int first, last;	/* range in renderrows */
+	unsigned int drawn;		/* cells drawn in that range */
+};
+extern struct renderer renderers[];
+extern unsigned int nrenderers;
+
+/*
+ * Contents of the framebuffer, as of the last redraw_term() and after
+ * replaying the pending moves.
+ */
+extern struct cellbuf oldbuf;
+
+/* Where the cursor currently is drawn, if cursordrawn is set */
+extern teken_pos_t drawncursor;
+extern bool cursordrawn;
+
+/*
+ * Cells which may differ between the terminal buffer and oldbuf, as a column
+ * range for each row, with a bitmap of the rows which have damage.
+ */
+extern struct rowdamage *termdamage;
+extern uint64_t *damagedrows;
+extern bool damaged;
+
+/* Cells drawn by redraw_term(), since the caller last cleared them */
+extern struct rowdamage *framedamage;
+
+/*
+ * Fast scroll mode: only the terminal buffer is updated, without any damage
+ * tracking. The caller marks everything as damaged when leaving it.
+ */
+extern bool modelonly;
+
+static inline cell_t **
+cellbuf_slot(struct cellbuf *cb, unsigned int row)
+{
+	row += cb->head;
+	if (row >= cb->nrows)
+		row -= cb->nrows;
+	return &cb->rows[row];
+}
+
+static inline cell_t *
+cellbuf_row(struct cellbuf *cb, unsigned int row)
+{
+	return *cellbuf_slot(cb, row);
+}
+
+static inline void
+add_damage(struct rowdamage *d, uint16_t x0, uint16_t x1)
+{
+	if (d->x0 >= d->x1) {
+		d->x0 = x0;
+		d->x1 = x1;
+	} else {
+		d->x0 = MIN(d->x0, x0);
+		d->x1 = MAX(d->x1, x1);
+	}
+}
+
+static inline cell_t *
+term_cell(struct terminal *t, uint16_t col, uint16_t row)
+{
+	return &cellbuf_row(&t->buf, row)[col];
+}
+
+/* The cells which are currently shown */
+static inline struct cellbuf *
+term_screen(struct terminal *t)
+{
+	return t->histoff > 0 ? &t->view : &t->buf;
+}
+
+/*
+ * Whether changes to the terminal need to be tracked for drawing. Hidden
+ * terminals may be parsed by a worker, so only look at their own state.
+ */
+static inline bool
+term_tracked(struct terminal *t)
+{
+	return t->shown && !modelonly;
+}
+
+static inline bool
+cursor_visible(struct terminal *t)
+{
+	return t->showcursor && t->histoff == 0;
+}
+
+static inline uint32_t
+color_id(teken_color_t c)
+{
+	return (c & TC_RGB) ? rgb_color_id(c) : c;
+}
+
+static inline cell_t
+make_cell(teken_char_t ch, const teken_attr_t *attr)
+{
+	return (cell_t)ch | (cell_t)attr->ta_format << 24 |
+	    (cell_t)color_id(attr->ta_fgcolor) << 32 |
+	    (cell_t)color_id(attr->ta_bgcolor) << 48;
+}
+
+static inline void
+mark_damage(uint16_t row, uint16_t x0, uint16_t x1)
+{
+	add_damage(&termdamage[row], x0, x1);
+	damagedrows[row / 64] |= (uint64_t)1 << (row % 64);
+	damaged = true;
+}
+
+int cellbuf_init(struct cellbuf *, unsigned int, unsigned int);
+void cellbuf_free(struct cellbuf *);
+bool cursor_moved(struct terminal *);
+int redraw_init(unsigned int, unsigned int, const teken_attr_t *);
+void redraw_free(void);
+unsigned int redraw_term(struct terminal *);
+void set_drawcontext(void *, uint16_t);
+void renderers_start(void);
+void renderers_stop(void);
+
+#endif /* !_TERM_H_ */